@@ -0,0 +1,577 @@
+/**
+ * Microbenchmarks for mod_wren, run outside of Apache against the stubs in
+ * httpd_stubs.c:
+ *
+ *   make bench
+ *
+ * or, to compare against an earlier run and fail on anything slower:
+ *
+ *   build/bench -o new.json -b old.json -t 10 bench/corpus
+ *
+ * mod_wren.c is included directly, so its static functions can be called.
+ */
+
+#include "../src/mod_wren.c"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "httpd_stubs.h"
+
+/* Each benchmark is timed for about this long, BENCH_REPEATS times over. */
+#define BENCH_TARGET_NS 200000000.0
+#define BENCH_REPEATS 5
+
+/*
+ * The VM is released and acquired again after this many operations, as a
+ * request would, so arena resets and collections are counted too.
+ */
+#define BENCH_OPS_PER_REQUEST 64
+
+/* How many copies of page.wrp make up the large template. */
+#define BENCH_LARGE_COPIES 64
+
+typedef void (*BenchFn)(void *data, size_t iterations);
+
+typedef struct {
+	const char *name;
+	size_t iterations;
+	double ns_per_op;   /* The median of BENCH_REPEATS runs. */
+	double bytes_per_op; /* Output written through ap_rputs() and friends. */
+} BenchResult;
+
+#define BENCH_MAX_RESULTS 128
+static BenchResult bench_results[BENCH_MAX_RESULTS];
+static size_t bench_num_results;
+
+static apr_pool_t *bench_pool;
+
+/* Stands in for r->per_dir_config, holding only mod_wren's config. */
+static void *bench_dir_configs[1];
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Times fn, first finding how many iterations take about BENCH_TARGET_NS, and
+ * records the median time per iteration.
+ */
+static void bench_run(const char *name, BenchFn fn, void *data)
+{
+	BenchResult *result = &bench_results[bench_num_results++];
+	double times[BENCH_REPEATS];
+	size_t iterations = 1;
+	apr_size_t bytes_before;
+	double elapsed;
+
+	/* Warm up, then double until a run is long enough to time. */
+	fn(data, 1);
+
+	for(;;) {
+		double start = bench_now();
+
+		fn(data, iterations);
+		elapsed = bench_now() - start;
+
+		if(elapsed >= BENCH_TARGET_NS / 10)
+			break;
+
+		iterations *= 2;
+	}
+
+	iterations = MAX(1, iterations * (BENCH_TARGET_NS / elapsed));
+	bytes_before = bench_bytes_written;
+
+	for(int i = 0; i < BENCH_REPEATS; ++i) {
+		double start = bench_now();
+
+		fn(data, iterations);
+		times[i] = (bench_now() - start) / iterations;
+	}
+
+	qsort(times, BENCH_REPEATS, sizeof(double), bench_compare_double);
+
+	result->name = name;
+	result->iterations = iterations;
+	result->ns_per_op = times[BENCH_REPEATS / 2];
+	result->bytes_per_op = (double)(bench_bytes_written - bytes_before) /
+		(iterations * BENCH_REPEATS);
+
+	fprintf(stderr, "%-40s %12.0f ns/op %10zu iterations\n", name,
+			result->ns_per_op, iterations);
+}
+
+/**
+ * Makes a GET request for a file, with the headers and environment a browser
+ * request through Apache would have.
+ */
+static request_rec* bench_request(apr_pool_t *pool, const char *filename,
+		const char *args)
+{
+	request_rec *r = apr_pcalloc(pool, sizeof(request_rec));
+
+	r->pool = pool;
+	r->server = &bench_server;
+	r->connection = &bench_connection;
+	r->log = &bench_logconf;
+	r->per_dir_config = (ap_conf_vector_t*)bench_dir_configs;
+	r->request_time = apr_time_now();
+
+	r->method = "GET";
+	r->method_number = M_GET;
+	r->handler = "wren";
+	r->status = HTTP_OK;
+	r->uri = apr_pstrcat(pool, "/", strrchr(filename, '/') + 1, NULL);
+	r->filename = apr_pstrdup(pool, filename);
+	r->canonical_filename = r->filename;
+	r->args = args != NULL ? apr_pstrdup(pool, args) : NULL;
+
+	r->headers_in = apr_table_make(pool, 16);
+	r->headers_out = apr_table_make(pool, 8);
+	r->err_headers_out = apr_table_make(pool, 4);
+	r->subprocess_env = apr_table_make(pool, 32);
+	r->notes = apr_table_make(pool, 4);
+
+	apr_table_setn(r->headers_in, "Host", "www.example.com");
+	apr_table_setn(r->headers_in, "User-Agent", "Mozilla/5.0 (X11; Linux "
+			"x86_64; rv:128.0) Gecko/20100101 Firefox/128.0");
+	apr_table_setn(r->headers_in, "Accept", "text/html,application/xhtml+xml,"
+			"application/xml;q=0.9,*/*;q=0.8");
+	apr_table_setn(r->headers_in, "Accept-Language", "en-GB,en;q=0.5");
+	apr_table_setn(r->headers_in, "Accept-Encoding", "gzip, deflate, br");
+	apr_table_setn(r->headers_in, "Connection", "keep-alive");
+	apr_table_setn(r->headers_in, "Cookie", "session=3f2a9c0d5e6b7a81; "
+			"theme=dark; _ga=GA1.2.1234567890.1700000000; consent=yes");
+	apr_table_setn(r->headers_in, "Upgrade-Insecure-Requests", "1");
+	apr_table_setn(r->headers_in, "Sec-Fetch-Dest", "document");
+	apr_table_setn(r->headers_in, "Sec-Fetch-Mode", "navigate");
+
+	apr_table_setn(r->subprocess_env, "SERVER_SOFTWARE", "Apache/2.4");
+	apr_table_setn(r->subprocess_env, "SERVER_NAME", "www.example.com");
+	apr_table_setn(r->subprocess_env, "SERVER_ADDR", "10.0.0.2");
+	apr_table_setn(r->subprocess_env, "SERVER_PORT", "443");
+	apr_table_setn(r->subprocess_env, "REMOTE_ADDR", "203.0.113.7");
+	apr_table_setn(r->subprocess_env, "DOCUMENT_ROOT", bench_document_root);
+	apr_table_setn(r->subprocess_env, "REQUEST_SCHEME", "https");
+	apr_table_setn(r->subprocess_env, "SCRIPT_FILENAME", r->filename);
+	apr_table_setn(r->subprocess_env, "REMOTE_PORT", "51234");
+	apr_table_setn(r->subprocess_env, "GATEWAY_INTERFACE", "CGI/1.1");
+	apr_table_setn(r->subprocess_env, "SERVER_PROTOCOL", "HTTP/1.1");
+	apr_table_setn(r->subprocess_env, "REQUEST_METHOD", "GET");
+	apr_table_setn(r->subprocess_env, "QUERY_STRING", r->args ?: "");
+	apr_table_setn(r->subprocess_env, "REQUEST_URI", r->uri);
+	apr_table_setn(r->subprocess_env, "SCRIPT_NAME", r->uri);
+	apr_table_setn(r->subprocess_env, "HTTPS", "on");
+
+	return r;
+}
+
+/*
+ * wren_parse()
+ */
+
+typedef struct {
+	WrenState *wren_state;
+	bool raw;
+} BenchParse;
+
+static void bench_parse(void *data, size_t iterations)
+{
+	BenchParse *parse = data;
+
+	for(size_t i = 0; i < iterations; ++i) {
+		char *wren_code = NULL;
+
+		if(wren_parse(parse->wren_state, &wren_code, parse->raw) != OK) {
+			fprintf(stderr, "Couldn't parse %s\n",
+					parse->wren_state->request_rec->filename);
+			exit(1);
+		}
+
+		free(wren_code);
+	}
+}
+
+/*
+ * wren_parse_url_params() and wren_fn_getEnv(), each with a VM acquired as
+ * it would be for a page.
+ */
+
+typedef struct {
+	const char *filename;
+	const char *args;
+	void (*fn)(WrenState *wren_state, const char *args);
+} BenchNative;
+
+static void bench_parse_url_params(WrenState *wren_state, const char *args)
+{
+	/* The arguments are parsed in place, so each run needs a fresh copy. */
+	char copy[strlen(args) + 1];
+
+	memcpy(copy, args, sizeof(copy));
+	wren_parse_url_params(wren_state, copy);
+}
+
+static void bench_get_env(WrenState *wren_state, const char *args)
+{
+	wren_fn_getEnv(wren_state->vm);
+}
+
+static void bench_native(void *data, size_t iterations)
+{
+	BenchNative *native = data;
+
+	while(iterations > 0) {
+		size_t ops = MIN(iterations, BENCH_OPS_PER_REQUEST);
+		apr_pool_t *pool;
+		WrenState *wren_state;
+
+		apr_pool_create(&pool, bench_pool);
+		wren_state = wren_acquire_state(bench_request(pool, native->filename,
+					native->args));
+
+		for(size_t i = 0; i < ops; ++i)
+			native->fn(wren_state, native->args);
+
+		wren_release_state(wren_state);
+		apr_pool_destroy(pool);
+
+		iterations -= ops;
+	}
+}
+
+/*
+ * Creating a VM, from scratch or as a copy of the template.
+ */
+
+static void bench_vm_prelude(void *data, size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+		wrenFreeVM(wren_prelude_vm());
+}
+
+static void bench_vm_clone(void *data, size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+		wrenFreeVM(wrenCloneVM(wren_template_vm));
+}
+
+/*
+ * The whole of wren_handler(): acquire, parse, compile, run and release.
+ */
+
+typedef struct {
+	const char *filename;
+	const char *args;
+} BenchHandler;
+
+static void bench_handler(void *data, size_t iterations)
+{
+	BenchHandler *handler = data;
+
+	for(size_t i = 0; i < iterations; ++i) {
+		apr_pool_t *pool;
+		int ret;
+
+		apr_pool_create(&pool, bench_pool);
+
+		if((ret = wren_handler(bench_request(pool, handler->filename,
+							handler->args))) != OK)
+		{
+			fprintf(stderr, "%s returned %d\n", handler->filename, ret);
+			exit(1);
+		}
+
+		apr_pool_destroy(pool);
+	}
+}
+
+/**
+ * Writes page.wrp out BENCH_LARGE_COPIES times, for a template of a few
+ * hundred kilobytes.
+ */
+static const char* bench_large_template(const char *corpus)
+{
+	char *path = apr_pstrdup(bench_pool, "/tmp/mod_wren_bench_XXXXXX.wrp");
+	char *source = apr_pstrcat(bench_pool, corpus, "/page.wrp", NULL);
+	FILE *in = fopen(source, "r");
+	char buf[65536];
+	size_t len;
+	int fd;
+	FILE *out;
+
+	if(in == NULL || (fd = mkstemps(path, 4)) == -1) {
+		fprintf(stderr, "Couldn't create the large template\n");
+		exit(1);
+	}
+
+	len = fread(buf, 1, sizeof(buf), in);
+	fclose(in);
+
+	out = fdopen(fd, "w");
+
+	for(int i = 0; i < BENCH_LARGE_COPIES; ++i)
+		fwrite(buf, 1, len, out);
+
+	fclose(out);
+
+	return path;
+}
+
+/**
+ * Writes the results as JSON, one benchmark per line so the baseline can be
+ * read back without a JSON parser.
+ */
+static void bench_write_results(FILE *out)
+{
+	fprintf(out, "{\n\"benchmarks\": [\n");
+
+	for(size_t i = 0; i < bench_num_results; ++i) {
+		const BenchResult *result = &bench_results[i];
+
+		fprintf(out, "{\"name\": \"%s\", \"iterations\": %zu, "
+				"\"ns_per_op\": %.1f, \"bytes_per_op\": %.1f}%s\n",
+				result->name, result->iterations, result->ns_per_op,
+				result->bytes_per_op, i + 1 < bench_num_results ? "," : "");
+	}
+
+	fprintf(out, "]\n}\n");
+}
+
+/**
+ * Compares the results to an earlier run's. Returns how many benchmarks are
+ * more than tolerance percent slower.
+ */
+static int bench_compare(const char *baseline_path, double tolerance)
+{
+	FILE *baseline = fopen(baseline_path, "r");
+	char line[1024];
+	int regressions = 0;
+
+	if(baseline == NULL) {
+		fprintf(stderr, "Couldn't open baseline %s\n", baseline_path);
+		return 1;
+	}
+
+	while(fgets(line, sizeof(line), baseline) != NULL) {
+		char name[256];
+		double ns_per_op;
+
+		if(sscanf(line, "{\"name\": \"%255[^\"]\", \"iterations\": %*u, "
+					"\"ns_per_op\": %lf", name, &ns_per_op) != 2)
+		{
+			continue;
+		}
+
+		for(size_t i = 0; i < bench_num_results; ++i) {
+			double change;
+
+			if(strcmp(bench_results[i].name, name) != 0)
+				continue;
+
+			change = (bench_results[i].ns_per_op / ns_per_op - 1) * 100;
+
+			if(change > tolerance) {
+				fprintf(stderr, "REGRESSION %-29s %+6.1f%%\n", name, change);
+				++regressions;
+			}
+		}
+	}
+
+	fclose(baseline);
+
+	return regressions;
+}
+
+static void bench_usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-o results.json] [-b baseline.json] "
+			"[-t percent] corpus_dir\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output_path = NULL, *baseline_path = NULL;
+	double tolerance = 10;
+	const char *corpus;
+	int opt;
+
+	while((opt = getopt(argc, argv, "o:b:t:")) != -1) {
+		switch(opt) {
+		case 'o': output_path = optarg; break;
+		case 'b': baseline_path = optarg; break;
+		case 't': tolerance = atof(optarg); break;
+		default: bench_usage(argv[0]);
+		}
+	}
+
+	if(optind != argc - 1)
+		bench_usage(argv[0]);
+
+	corpus = realpath(argv[optind], NULL);
+
+	if(corpus == NULL) {
+		fprintf(stderr, "Couldn't find the corpus %s\n", argv[optind]);
+		return 2;
+	}
+
+	apr_initialize();
+	apr_pool_create(&bench_pool, NULL);
+
+	bench_document_root = corpus;
+	bench_server.server_hostname = "www.example.com";
+	bench_connection.log = &bench_logconf;
+
+	/* Start mod_wren as a child would. */
+	wren_module.module_index = 0;
+	bench_dir_configs[0] = wren_create_dir_config(bench_pool, NULL);
+	wren_pre_config(bench_pool, bench_pool, bench_pool);
+	module_init(bench_pool, &bench_server);
+
+	/* The templates in the corpus, and one built from many copies of a page. */
+	{
+		static BenchParse parses[BENCH_MAX_RESULTS];
+		const char *large = bench_large_template(corpus);
+		DIR *dir = opendir(corpus);
+		struct dirent *entry;
+		size_t num_parses = 0;
+
+		while((entry = readdir(dir)) != NULL) {
+			const char *extension = strrchr(entry->d_name, '.');
+			const char *filename;
+
+			if(extension == NULL || (strcmp(extension, ".wrp") != 0 &&
+						strcmp(extension, ".wren") != 0))
+			{
+				continue;
+			}
+
+			filename = apr_pstrcat(bench_pool, corpus, "/", entry->d_name,
+					NULL);
+
+			parses[num_parses].raw = strcmp(extension, ".wren") == 0;
+			parses[num_parses].wren_state = wren_acquire_state(
+					bench_request(bench_pool, filename, NULL));
+
+			bench_run(apr_pstrcat(bench_pool, "parse/", entry->d_name, NULL),
+					bench_parse, &parses[num_parses]);
+
+			wren_release_state(parses[num_parses++].wren_state);
+		}
+
+		closedir(dir);
+
+		parses[num_parses].raw = false;
+		parses[num_parses].wren_state = wren_acquire_state(
+				bench_request(bench_pool, large, NULL));
+
+		bench_run("parse/large.wrp", bench_parse, &parses[num_parses]);
+
+		wren_release_state(parses[num_parses].wren_state);
+		unlink(large);
+	}
+
+	/* Query strings, from the everyday to the hostile. */
+	{
+		const char *page = apr_pstrcat(bench_pool, corpus, "/page.wren", NULL);
+		static BenchNative params[] = {
+			{ NULL, "q=apache+modules&page=2&sort=price", NULL },
+			{ NULL, "utm_source=newsletter&utm_medium=email&utm_campaign="
+				"spring%20sale&utm_content=hero&utm_term=kettles&ref=home&"
+				"lang=en-GB&currency=GBP&q=stainless+steel+kettle&page=1&"
+				"sort=price&order=asc&min=10&max=100&in_stock=1", NULL },
+			{ NULL, NULL, NULL }, /* Many distinct keys, filled below. */
+			{ NULL, NULL, NULL }, /* One key repeated, filled below. */
+			{ NULL, NULL, NULL }, /* A long, fully escaped value. */
+			{ NULL, "a=&b=&c=&d=&e=&f=&g=&h=&=&&&=x&%zz=%zz&k=%", NULL },
+		};
+		static const char *names[] = {
+			"params/short", "params/tracking", "params/distinct_keys",
+			"params/repeated_key", "params/escaped_value", "params/malformed"
+		};
+		char *distinct = "", *repeated = "", *escaped = "v=";
+
+		for(int i = 0; i < 256; ++i) {
+			distinct = apr_psprintf(bench_pool, "%s%skey%d=value%d", distinct,
+					i > 0 ? "&" : "", i, i);
+			repeated = apr_psprintf(bench_pool, "%s%sid=%d", repeated,
+					i > 0 ? "&" : "", i);
+		}
+
+		for(int i = 0; i < 4096; ++i)
+			escaped = apr_pstrcat(bench_pool, escaped, "%E2%9C%93", NULL);
+
+		params[2].args = distinct;
+		params[3].args = repeated;
+		params[4].args = escaped;
+
+		for(size_t i = 0; i < sizeof(params) / sizeof(params[0]); ++i) {
+			params[i].filename = page;
+			params[i].fn = bench_parse_url_params;
+			bench_run(names[i], bench_native, &params[i]);
+		}
+
+		static BenchNative env = { NULL, NULL, bench_get_env };
+
+		env.filename = page;
+		bench_run("native/getEnv", bench_native, &env);
+	}
+
+	bench_run("vm/prelude", bench_vm_prelude, NULL);
+
+	if(wren_template_vm != NULL)
+		bench_run("vm/clone", bench_vm_clone, NULL);
+
+	/* Whole requests. */
+	{
+		static BenchHandler handlers[] = {
+			{ "small.wrp", "name=bench" },
+			{ "page.wrp", "page=2&sort=price" },
+			{ "page.wren", "count=100" },
+		};
+
+		for(size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); ++i) {
+			const char *name = handlers[i].filename;
+
+			handlers[i].filename = apr_pstrcat(bench_pool, corpus, "/", name,
+					NULL);
+			bench_run(apr_pstrcat(bench_pool, "request/", name, NULL),
+					bench_handler, &handlers[i]);
+		}
+	}
+
+	if(output_path != NULL) {
+		FILE *out = fopen(output_path, "w");
+
+		if(out == NULL) {
+			fprintf(stderr, "Couldn't write %s\n", output_path);
+			return 2;
+		}
+
+		bench_write_results(out);
+		fclose(out);
+	} else {
+		bench_write_results(stdout);
+	}
+
+	if(baseline_path != NULL && bench_compare(baseline_path, tolerance) > 0)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,258 @@
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <ap_mpm.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_core.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <apache2/mod_dbd.h>
+
+#include "httpd_stubs.h"
+
+apr_size_t bench_bytes_written;
+const char *bench_document_root = ".";
+
+/* Only errors are logged, so the benchmarks aren't timing stderr. */
+struct ap_logconf bench_logconf = { NULL, APLOG_ERR };
+server_rec bench_server;
+conn_rec bench_connection;
+
+/*
+ * Output. Pages are formatted as they would be, but the result is only
+ * counted.
+ */
+
+AP_DECLARE_NONSTD(int) ap_rprintf(request_rec *r, const char *fmt, ...)
+{
+	char buf[8192];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	bench_bytes_written += len;
+
+	return len;
+}
+
+AP_DECLARE(int) ap_rputs(const char *str, request_rec *r)
+{
+	apr_size_t len = strlen(str);
+
+	bench_bytes_written += len;
+
+	return len;
+}
+
+AP_DECLARE(int) ap_rwrite(const void *buf, int nbyte, request_rec *r)
+{
+	bench_bytes_written += nbyte;
+
+	return nbyte;
+}
+
+AP_DECLARE(void) ap_set_content_type(request_rec *r, const char *ct)
+{
+	r->content_type = ct;
+}
+
+AP_DECLARE(void) ap_set_content_length(request_rec *r, apr_off_t length)
+{
+	r->clength = length;
+}
+
+AP_DECLARE(void) ap_send_interim_response(request_rec *r, int send_headers)
+{
+	apr_table_clear(r->headers_out);
+}
+
+AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *filter,
+		apr_bucket_brigade *bb)
+{
+	apr_off_t len = 0;
+
+	apr_brigade_length(bb, 1, &len);
+	bench_bytes_written += len;
+
+	return apr_brigade_cleanup(bb);
+}
+
+AP_DECLARE(void) ap_update_mtime(request_rec *r, apr_time_t dependency_mtime)
+{
+	if(r->mtime < dependency_mtime)
+		r->mtime = dependency_mtime;
+}
+
+AP_DECLARE(void) ap_set_last_modified(request_rec *r) {}
+
+AP_DECLARE(void) ap_set_etag(request_rec *r) {}
+
+/* Benchmarked requests aren't conditional. */
+AP_DECLARE(int) ap_meets_conditions(request_rec *r)
+{
+	return OK;
+}
+
+/*
+ * Request bodies. Benchmarked requests don't have one.
+ */
+
+AP_DECLARE(int) ap_setup_client_block(request_rec *r, int read_policy)
+{
+	r->remaining = 0;
+
+	return OK;
+}
+
+AP_DECLARE(int) ap_should_client_block(request_rec *r)
+{
+	return 0;
+}
+
+AP_DECLARE(long) ap_get_client_block(request_rec *r, char *buffer,
+		apr_size_t bufsiz)
+{
+	return 0;
+}
+
+/*
+ * Utilities, matching the behaviour of httpd's server/util.c.
+ */
+
+AP_DECLARE(char *) ap_getword(apr_pool_t *p, const char **line, char stop)
+{
+	const char *pos = *line;
+	char *res;
+
+	while(*pos != stop && *pos)
+		++pos;
+
+	res = apr_pstrmemdup(p, *line, pos - *line);
+
+	if(stop) {
+		while(*pos == stop)
+			++pos;
+	}
+
+	*line = pos;
+
+	return res;
+}
+
+static int bench_hex_value(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+
+	return (c | 0x20) - 'a' + 10;
+}
+
+AP_DECLARE(int) ap_unescape_url(char *url)
+{
+	char *in = url, *out = url;
+	int bad = 0;
+
+	for(; *in != '\0'; ++in, ++out) {
+		if(*in != '%') {
+			*out = *in;
+			continue;
+		}
+
+		if(!apr_isxdigit(in[1]) || !apr_isxdigit(in[2])) {
+			bad = 1;
+			*out = '%';
+			continue;
+		}
+
+		*out = bench_hex_value(in[1]) * 16 + bench_hex_value(in[2]);
+		in += 2;
+	}
+
+	*out = '\0';
+
+	return bad ? HTTP_BAD_REQUEST : OK;
+}
+
+AP_DECLARE(const char *) ap_context_document_root(request_rec *r)
+{
+	return bench_document_root;
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname)
+{
+	return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(char *) ap_runtime_dir_relative(apr_pool_t *p, const char *fname)
+{
+	return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(int) ap_state_query(int query_code)
+{
+	return AP_SQ_MS_RUN_MPM;
+}
+
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int *result)
+{
+	*result = 1;
+
+	return APR_SUCCESS;
+}
+
+/*
+ * Logging goes to stderr.
+ */
+
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index,
+		int level, apr_status_t status, const server_rec *s,
+		const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "%s:%d: ", file, line);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+AP_DECLARE(void) ap_log_rerror_(const char *file, int line, int module_index,
+		int level, apr_status_t status, const request_rec *r,
+		const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "%s:%d: ", file, line);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+/*
+ * Hooks are never run, and there's no mod_dbd to hand out connections.
+ */
+
+AP_DECLARE(void) ap_hook_pre_config(ap_HOOK_pre_config_t *pf,
+		const char * const *pre, const char * const *succ, int order) {}
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t *pf,
+		const char * const *pre, const char * const *succ, int order) {}
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t *pf,
+		const char * const *pre, const char * const *succ, int order) {}
+AP_DECLARE(void) ap_hook_handler(ap_HOOK_handler_t *pf,
+		const char * const *pre, const char * const *succ, int order) {}
+AP_DECLARE(void) ap_hook_log_transaction(ap_HOOK_log_transaction_t *pf,
+		const char * const *pre, const char * const *succ, int order) {}
+
+DBD_DECLARE_NONSTD(ap_dbd_t*) ap_dbd_acquire(request_rec *r)
+{
+	return NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef MOD_WREN_HTTPD_STUBS_H
+#define MOD_WREN_HTTPD_STUBS_H
+
+/**
+ * Just enough of httpd for mod_wren to run outside of Apache. APR is the real
+ * library; only functions that live in the httpd binary itself are stubbed.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+
+/* Bytes pages have written through ap_rputs() and friends. */
+extern apr_size_t bench_bytes_written;
+
+/* Returned by ap_context_document_root(), for relative imports. */
+extern const char *bench_document_root;
+
+/* Used by every request, so logging checks and r->server work. */
+extern server_rec bench_server;
+extern conn_rec bench_connection;
+extern struct ap_logconf bench_logconf;
+
+#endif
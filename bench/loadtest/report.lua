@@ -0,0 +1,47 @@
+-- wrk script: optionally POSTs a checkout form or numbers requests, and prints
+-- one JSON line of results tagged with the MPM, page and concurrency given by
+-- run.sh.
+
+if os.getenv("LOADTEST_POST") == "1" then
+	wrk.method = "POST"
+	wrk.headers["Content-Type"] = "application/x-www-form-urlencoded"
+	wrk.body = "name=Ada+Lovelace&email=ada%40example.com" ..
+		"&address=12+Analytical+Row%2C+London&postcode=NW1+6XE" ..
+		"&card=4111111111111111&expiry=12%2F29&notes=Leave+with+a+neighbour" ..
+		"&gift=on&newsletter=on&items=kettle&items=teapot&items=mug" ..
+		"&coupon=SPRING&delivery=next_day"
+end
+
+-- Each request to suspend.wrp gets an id of its own, which the page checks
+-- is still its own after waiting on a query.
+if os.getenv("LOADTEST_PAGE") == "suspend.wrp" then
+	local threads = 0
+
+	function setup(thread)
+		threads = threads + 1
+		thread:set("thread_id", threads)
+	end
+
+	local counter = 0
+
+	function request()
+		counter = counter + 1
+		return wrk.format(nil, "/suspend.wrp?id=" .. thread_id .. "-" .. counter)
+	end
+end
+
+function done(summary, latency, requests)
+	local errors = summary.errors.connect + summary.errors.read +
+		summary.errors.write + summary.errors.status + summary.errors.timeout
+
+	io.write(string.format(
+		'{"mpm": "%s", "page": "%s", "concurrency": %d, ' ..
+		'"requests": %d, "errors": %d, "requests_per_sec": %.1f, ' ..
+		'"p50_ms": %.3f, "p99_ms": %.3f, "p999_ms": %.3f, "max_ms": %.3f}\n',
+		os.getenv("LOADTEST_MPM"), os.getenv("LOADTEST_PAGE"),
+		tonumber(os.getenv("LOADTEST_CONCURRENCY")),
+		summary.requests, errors,
+		summary.requests / (summary.duration / 1e6),
+		latency:percentile(50) / 1000, latency:percentile(99) / 1000,
+		latency:percentile(99.9) / 1000, latency.max / 1000))
+end
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# End-to-end load test: starts a throwaway httpd with mod_wren and mod_dbd's
+# SQLite driver, deploys the pages in site/, and drives each of them with wrk
+# at several concurrencies under the prefork and event MPMs.
+#
+# Results are printed as a table and written as JSON lines to $OUTPUT.
+#
+#   make loadtest
+#   bench/loadtest/run.sh [-d seconds] [-c "1 16 64"] [-m "prefork event"]
+#
+# Requires httpd (or apache2) with apxs, the sqlite3 apr-util DBD driver, the
+# sqlite3 shell, curl and wrk.
+#
+set -euf # No globbing, so the query strings in $PAGES are left alone.
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$HERE/../.." && pwd)
+
+DURATION=${DURATION:-10}
+CONCURRENCY=${CONCURRENCY:-"1 8 32 128"}
+MPMS=${MPMS:-"prefork event"}
+PORT=${PORT:-8089}
+OUTPUT=${OUTPUT:-"$ROOT/build/loadtest.json"}
+MOD_WREN=${MOD_WREN:-"$ROOT/build/.libs/mod_wren.so"}
+
+# Each page, and the query string it's requested with.
+PAGES="static.wrp interpolate.wrp?name=Ada&rows=100 db.wrp?category=3
+post.wrp api.wren?count=200 suspend.wrp"
+
+while getopts d:c:m: opt; do
+	case $opt in
+		d) DURATION=$OPTARG ;;
+		c) CONCURRENCY=$OPTARG ;;
+		m) MPMS=$OPTARG ;;
+		*) echo "Usage: $0 [-d seconds] [-c concurrencies] [-m mpms]" >&2
+		   exit 2 ;;
+	esac
+done
+
+for tool in apxs curl sqlite3 wrk; do
+	if ! command -v $tool >/dev/null 2>&1; then
+		echo "$tool is required" >&2
+		exit 2
+	fi
+done
+
+if [ ! -f "$MOD_WREN" ]; then
+	echo "$MOD_WREN doesn't exist; run make first, or set MOD_WREN" >&2
+	exit 2
+fi
+
+HTTPD=$(apxs -q SBINDIR)/$(apxs -q PROGNAME)
+MODULES=$(apxs -q LIBEXECDIR)
+THREADS=$(nproc 2>/dev/null || echo 4)
+
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/mod_wren_loadtest.XXXXXX")
+trap 'stop_httpd; rm -rf "$WORKDIR"' EXIT INT TERM
+
+cp -R "$HERE/site" "$WORKDIR/site"
+sqlite3 "$WORKDIR/site.db" < "$HERE/schema.sql"
+mkdir -p "$(dirname "$OUTPUT")"
+: > "$OUTPUT"
+
+start_httpd() {
+	sed -e "s|@WORKDIR@|$WORKDIR|g" -e "s|@PORT@|$PORT|g" \
+		-e "s|@MPM@|$1|g" -e "s|@MODULES@|$MODULES|g" \
+		-e "s|@MOD_WREN@|$MOD_WREN|g" \
+		"$HERE/httpd.conf.in" > "$WORKDIR/httpd.conf"
+
+	"$HTTPD" -f "$WORKDIR/httpd.conf" -k start
+
+	# Wait until it answers, for up to ten seconds.
+	for i in $(seq 100); do
+		if curl -sf -o /dev/null "http://127.0.0.1:$PORT/static.wrp"; then
+			return
+		fi
+		sleep 0.1
+	done
+
+	echo "httpd didn't start; see $WORKDIR/error.log" >&2
+	cat "$WORKDIR/error.log" >&2
+	exit 1
+}
+
+stop_httpd() {
+	if [ -f "$WORKDIR/httpd.pid" ]; then
+		"$HTTPD" -f "$WORKDIR/httpd.conf" -k stop 2>/dev/null || true
+
+		while [ -f "$WORKDIR/httpd.pid" ]; do
+			sleep 0.1
+		done
+	fi
+}
+
+printf "%-8s %-16s %5s %10s %9s %9s %9s %7s\n" \
+	MPM PAGE CONC REQ/S P50_MS P99_MS P999_MS ERRORS
+
+for mpm in $MPMS; do
+	start_httpd "$mpm"
+
+	for page in $PAGES; do
+		name=${page%%\?*}
+		post=0
+		case $name in post.*) post=1 ;; esac
+
+		for concurrency in $CONCURRENCY; do
+			threads=$((concurrency < THREADS ? concurrency : THREADS))
+
+			# A short warm up, so every child has compiled its VMs.
+			wrk -t "$threads" -c "$concurrency" -d 1 \
+				"http://127.0.0.1:$PORT/$page" >/dev/null
+
+			LOADTEST_MPM=$mpm LOADTEST_PAGE=$name LOADTEST_POST=$post \
+				LOADTEST_CONCURRENCY=$concurrency \
+				wrk -t "$threads" -c "$concurrency" -d "$DURATION" \
+					--latency -s "$HERE/report.lua" \
+					"http://127.0.0.1:$PORT/$page" |
+				grep '^{' | tee -a "$OUTPUT" |
+				sed -e 's/[{}"]//g' -e 's/[a-z0-9_]*: //g' |
+				awk -F', ' '{ printf "%-8s %-16s %5d %10.1f %9.3f %9.3f %9.3f %7d\n",
+					$1, $2, $3, $6, $7, $8, $9, $5 }'
+		done
+	done
+
+	stop_httpd
+done
+
+echo "Results written to $OUTPUT"
@@ -0,0 +1,35 @@
+-- Fixture data for db.wrp: 10 categories of 100 products, each with reviews.
+create table products (
+	id integer primary key,
+	category integer not null,
+	name text not null,
+	price real not null,
+	stock integer not null
+);
+create index products_category on products (category);
+
+create table reviews (
+	id integer primary key,
+	product integer not null,
+	rating integer not null,
+	body text not null
+);
+create index reviews_product on reviews (product);
+
+create table stats (
+	category integer primary key,
+	views integer not null
+);
+
+with recursive n(i) as (select 1 union all select i + 1 from n where i < 1000)
+insert into products (id, category, name, price, stock)
+	select i, (i - 1) / 100 + 1, 'Product ' || i, (i * 37 % 10000) / 100.0,
+		i * 13 % 50
+	from n;
+
+with recursive n(i) as (select 1 union all select i + 1 from n where i < 5000)
+insert into reviews (product, rating, body)
+	select i % 1000 + 1, i % 5 + 1, 'Review number ' || i from n;
+
+with recursive n(i) as (select 1 union all select i + 1 from n where i < 10)
+insert into stats (category, views) select i, 0 from n;
@@ -0,0 +1,34 @@
+/**
+ * A minimal mod_wren extension. Build it with:
+ *
+ *   cc -shared -fPIC -I/usr/include/apache2 -I/usr/include/apr-1.0 \
+ *     -Iexternal/wren/src/include -Isrc docs/examples/extension.c \
+ *     -o pricing.so
+ *
+ * And load it with:
+ *
+ *   ModWrenExtension pricing /usr/lib/mod_wren/pricing.so
+ */
+#include "mod_wren_extension.h"
+
+static void pricing_with_tax(WrenVM *vm)
+{
+	double price = wrenGetSlotDouble(vm, 1);
+	double rate  = wrenGetSlotDouble(vm, 2);
+
+	wrenSetSlotDouble(vm, 0, price + price * rate);
+}
+
+static const ModWrenMethod pricing_methods[] = {
+	{ "Pricing", true, "withTax(_,_)", pricing_with_tax },
+	{ NULL }
+};
+
+const ModWrenExtension mod_wren_extension = {
+	MOD_WREN_EXTENSION_VERSION,
+	"class Pricing {\n"
+	"	foreign static withTax(price, rate)\n"
+	"}\n",
+	pricing_methods,
+	NULL
+};
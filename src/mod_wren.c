@@ -1,8 +1,16 @@
 #include <apr_dbd.h>
+#include <apr_dso.h>
+#include <apr_file_io.h>
+#include <apr_general.h>
 #include <apr_hash.h>
+#include <apr_lib.h>
+#include <apr_md5.h>
 #include <apr_pools.h>
+#include <apr_shm.h>
 #include <apr_strings.h>
 #include <apr_tables.h>
+#include <apr_buckets.h>
+#include <ap_mpm.h>
 #include <httpd.h>
 #include <http_config.h>
 #include <http_log.h>
@@ -10,45 +18,759 @@
 #include <pthread.h>
 
 #include <apache2/mod_dbd.h>
+#include <zlib.h>
 
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "wren.h"
+#include "mod_wren_extension.h"
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
+/**
+ * Memory handed to Wren while a request is running comes from a bump arena of
+ * WrenArenaChunks. Each chunk counts its live allocations, so freeing is a
+ * decrement and a chunk whose objects have all died is reclaimed whole.
+ *
+ * Anything that outlives the request keeps its chunk pinned until it's
+ * freed, at which point the chunk goes back to be reused.
+ */
+typedef struct WrenArenaChunk {
+	struct WrenArenaChunk *next;
+	size_t used;
+	size_t capacity;
+	size_t live;
+	size_t live_bytes; /* Including headers and alignment. */
+} WrenArenaChunk;
+
+typedef struct {
+	WrenArenaChunk *current; /* The chunk allocations are bumped from. */
+	WrenArenaChunk *full;    /* Filled chunks, which may hold survivors. */
+	WrenArenaChunk *spare;   /* Empty chunks ready to reuse. */
+	size_t num_spare;
+} WrenArena;
+
+/**
+ * Every allocation handed to Wren is preceded by a header, so we can tell
+ * arena memory from general heap memory when Wren reallocates or frees it.
+ */
+typedef union {
+	struct {
+		WrenArenaChunk *chunk; /* NULL if allocated from the general heap. */
+		size_t size;
+	};
+	max_align_t align;
+} WrenAllocHeader;
+
+#define WREN_ALIGN(size) \
+	(((size) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+/* Bytes available to allocations in each arena chunk. */
+#define WREN_ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Allocations larger than this skip the arena and use the heap. */
+#define WREN_ARENA_LARGE_ALLOC (WREN_ARENA_CHUNK_SIZE / 4)
+
+/* Empty chunks kept per VM between requests; the rest are freed. */
+#define WREN_ARENA_SPARE_CHUNKS 4
+
 /**
  * A WrenState contains a VM and everything relevant to the current request
  * it's serving.
+ *
+ * request_rec must stay the first member: extensions reach it through
+ * mod_wren_request().
  */
 typedef struct {
 	request_rec *request_rec;
 	const char *content_type;
 	int status_code;
 	int return_code;
+	apr_table_t *cookies; /* Parsed from the Cookie header on first use. */
 	bool lock;
-	WrenVM *vm;
+	WrenArena arena;
+	size_t heap_size; /* Bytes currently allocated by the VM. */
+	size_t heap_base; /* heap_size when the VM was created. */
+	size_t heap_reported; /* heap_size as last added to wren_metrics. */
+	bool heap_exceeded;
+	jmp_buf *escape; /* Set by wren_run() while page code is running. */
+	bool broken; /* Left mid-instruction by a refused allocation. */
+	apr_time_t deadline; /* When the request runs out of time, or 0. */
+	apr_int64_t step_limit;
+	apr_int64_t steps; /* Calls and loop iterations run so far. */
+	bool budget_exceeded;
+	apr_array_header_t *spans; /* WrenSpans, if ModWrenTiming is on. */
+	struct WrenProfile *profile; /* Samples, if the request is profiled. */
+	struct WrenSlow *slow; /* Kept for ModWrenSlowLog, if it's set. */
+	apr_bucket_brigade *output; /* Page output, held back to be cached. */
+	bool files; /* Whether output has files in it from Web.sendFile(). */
+	bool personal; /* Whether the page read request headers or variables. */
+	apr_array_header_t *preloads; /* Link header values from Web.preload(). */
+	int preloads_sent; /* How many of them went out as Early Hints. */
+	apr_array_header_t *deferred; /* WrenHandles passed to Web.defer(). */
+	apr_pool_t *partials_pool; /* Lives until the modules are unloaded. */
+	apr_hash_t *partials; /* WrenPartials by path, compiled by the VM. */
+	apr_time_t last_used; /* When the state was last released. */
+	apr_uint64_t requests; /* Requests run by the current VM. */
+	int suspended; /* Requests waiting on ModWrenAsyncDB queries. */
+	int resuming; /* ...and those of them waiting to take the VM back. */
+	bool recreate_pending; /* To be recreated once they're all released. */
+	WrenHandle *pending_fiber; /* Suspended by WebDB.query() to wait on... */
+	apr_array_header_t *pending; /* ...these WrenQueries. */
+	struct WrenPool *pool; /* The pool the state belongs to. */
+	WrenVM *vm; /* NULL until the state is first used, and once trimmed. */
 } WrenState;
 
-/* TODO: make database inclusion a compile-time option. */
+/**
+ * Per-directory configuration, set by directives inside <Directory>,
+ * <Location> and <VirtualHost> blocks. Unset values are -1.
+ */
+typedef struct {
+	apr_interval_time_t time_limit; /* Set by ModWrenTimeLimit. */
+	apr_int64_t step_limit;         /* Set by ModWrenStepLimit. */
+	int timing;                     /* Set by ModWrenTiming. */
+	int profile;                    /* Set by ModWrenProfile. */
+	apr_interval_time_t output_cache; /* Set by ModWrenOutputCache. */
+	int pool; /* Set by ModWrenPool, an index in wren_pools. */
+} WrenDirConfig;
+
+/**
+ * A page compiled by Web.include(). A VM keeps it until the request is
+ * released, or the file is modified.
+ */
+typedef struct {
+	WrenHandle *compiled;
+	apr_time_t mtime;
+} WrenPartial;
+
+/**
+ * The parts of a WrenState that belong to its request rather than its VM. A
+ * request waiting on a ModWrenAsyncDB query keeps them here while other
+ * requests use the VM.
+ */
+typedef struct {
+	request_rec *request_rec;
+	const char *content_type;
+	int status_code;
+	int return_code;
+	apr_table_t *cookies;
+	apr_time_t deadline;
+	apr_int64_t step_limit;
+	apr_int64_t steps;
+	apr_array_header_t *spans;
+	struct WrenProfile *profile;
+	struct WrenSlow *slow;
+	apr_bucket_brigade *output;
+	bool files;
+	bool personal;
+	apr_array_header_t *preloads;
+	int preloads_sent;
+	apr_array_header_t *deferred;
+	WrenHandle *statics; /* Web's static fields, from wren_save_statics(). */
+} WrenRequestContext;
+
+/**
+ * Kept in a request's config while its deferred work waits for the response
+ * to be sent. The VM is suspended meanwhile, and free for other requests.
+ */
 typedef struct {
+	WrenState *wren_state;
+	WrenRequestContext context;
+	apr_time_t start; /* When the request started, for the span log. */
+	int ret;          /* What the handler returned. */
+	server_rec *server; /* For logging once the request is being torn down. */
+	const char *uri;
+} WrenDeferred;
+
+/* TODO: make database inclusion a compile-time option. */
+typedef struct DatabaseConn {
 	apr_dbd_t *handle;
 	const apr_dbd_driver_t *driver;
 	bool alive;
 	const char *error;
 	apr_pool_t *pool;
+	const char *params; /* For opening spares. */
+	apr_array_header_t *spares; /* More handles, for queries run in parallel. */
+	int claimed; /* Handles given to the batch of queries being run. */
 } DatabaseConn;
 
-/* TODO: Add mutex locks for enabling multiple states. */
-#define NUM_WREN_STATES 8
-static WrenState *wren_states;
+/**
+ * A query run by WebDB.queryAll() or Web.parallel() alongside the others in
+ * its batch. Each has a connection and a pool of its own, since neither can
+ * be shared between threads.
+ */
+typedef struct WrenQuery {
+	DatabaseConn *db;
+	const char *query;
+	apr_dbd_t *handle; /* NULL if the query can't be run. */
+	apr_pool_t *pool;
+	apr_dbd_results_t *results; /* NULL if it failed. */
+	const char *error;
+	apr_time_t start;
+	apr_time_t end;
+	pthread_t thread;
+	bool threaded;
+} WrenQuery;
+
+/*
+ * One of a child's pools of states. A state's VM is created the first time
+ * it's needed and destroyed once it has been idle for ModWrenPoolIdleTimeout,
+ * so the pool grows and shrinks with the child's load.
+ *
+ * Pages only run on the VMs of the pool ModWrenPool gives them, so slow pages
+ * in one pool can't take every VM from the pages in another. Pool 0 is
+ * "default", sized by ModWrenPoolMax, for pages that aren't given one.
+ */
+typedef struct WrenPool {
+	const char *name;
+	int index; /* In wren_pools and wren_metrics->pools. */
+	WrenState *states;
+	size_t size;
+	size_t num_vms;
+	int waiting; /* Requests queued for a VM. */
+	pthread_cond_t available; /* Signalled when a VM comes free... */
+	pthread_cond_t resumable; /* ...or for a suspended request to resume on. */
+} WrenPool;
+
+/*
+ * wren_states_lock guards every state's lock, vm, suspended and resuming, and
+ * each pool's num_vms and waiting.
+ */
+static WrenPool *wren_pools;
+static int wren_num_pools;
 static pthread_mutex_t wren_states_lock;
 
+/* The most pools there can be, default included. */
+#define WREN_POOLS_MAX 16
+
+/*
+ * Set by ModWrenPool: each pool's name and VMs per child, in the order
+ * they're first named. The default pool comes first, with a size of 0.
+ */
+typedef struct {
+	const char *name;
+	int size;
+} WrenPoolDef;
+
+static apr_array_header_t *wren_pool_defs;
+
+/* The thread that trims idle VMs, and how child exit stops it. */
+static pthread_t wren_trim_thread;
+static pthread_cond_t wren_trim_cond;
+static bool wren_trim_running;
+static bool wren_trim_stop;
+
+#define WREN_POOL_MIN_DEFAULT 1
+#define WREN_POOL_IDLE_TIMEOUT_DEFAULT apr_time_from_sec(60)
+
+/*
+ * Set by ModWrenPoolMin and ModWrenPoolMax: how many VMs a child keeps
+ * however idle it is, and the most it creates however busy. A maximum of 0
+ * follows the MPM's threads per child.
+ */
+static int wren_pool_min = WREN_POOL_MIN_DEFAULT;
+static int wren_pool_max;
+
+/*
+ * Set by ModWrenPoolIdleTimeout. VMs unused for this long are destroyed,
+ * down to ModWrenPoolMin. Zero to keep them.
+ */
+static apr_interval_time_t wren_pool_idle_timeout =
+	WREN_POOL_IDLE_TIMEOUT_DEFAULT;
+
+/*
+ * Set by ModWrenRecycleRequests and ModWrenRecycleFragmentation. A VM is
+ * replaced after running this many requests, or once this percentage of the
+ * arena memory its survivors pin is going unused. Zero to never replace.
+ */
+static apr_uint64_t wren_recycle_requests;
+static int wren_recycle_fragmentation;
+
+/*
+ * Set by ModWrenQueueMax and ModWrenQueueTimeout: how many requests may wait
+ * for one of a pool's VMs in each child, and for how long, before they're
+ * turned away with a 503. -1 and 0 respectively to let them wait for good.
+ */
+static int wren_queue_max = -1;
+static apr_interval_time_t wren_queue_timeout;
+
+/*
+ * Set by ModWrenAsyncDB. A page's WebDB.query() suspends its fiber and gives
+ * up the VM while the query runs.
+ */
+static bool wren_async_db;
+
+/*
+ * The most queries a WebDB.queryAll() or Web.parallel() batch runs at once,
+ * each with a thread and a connection. Bigger batches run in waves.
+ */
+#define WREN_PARALLEL_QUERIES_MAX 8
+
+/*
+ * Fragmentation is only worth a new VM once survivors pin at least this many
+ * arena chunks.
+ */
+#define WREN_FRAGMENTATION_MIN_CHUNKS 4
+
+/*
+ * The state whose VM the current thread is running. Wren's allocator doesn't
+ * take user data, so this is how wren_reallocate() finds the arena to use and
+ * the heap to account to.
+ */
+static __thread WrenState *wren_active_state;
+
+/* Shared by every VM, filled in by module_init(). */
+static WrenConfiguration wren_config;
+
+/*
+ * A VM that has run the prelude but never a page, built by module_init().
+ * Every state's VM starts out as a copy of it. Its allocations aren't
+ * accounted to any state. Only ever read once threads are running: it's
+ * dropped in module_init() if it can't be copied, and lasts for the child.
+ */
+static WrenVM *wren_template_vm;
+
+/*
+ * Set by the ModWrenHeapInitial, ModWrenHeapMin and ModWrenHeapGrowth
+ * directives. Zero leaves Wren's default.
+ */
+static size_t wren_initial_heap_size;
+static size_t wren_min_heap_size;
+static int wren_heap_growth_percent;
+
+/*
+ * Set by the ModWrenHeapLimit directive. A request whose VM grows past this
+ * has its fiber aborted. Zero for no limit.
+ */
+static size_t wren_heap_limit;
+
+/*
+ * Set by the ModWrenHeapWatermark directive. A VM still holding more than
+ * this after a request is replaced with a fresh one. Zero to never replace.
+ */
+static size_t wren_heap_watermark;
+
+#define WREN_HEAP_LIMIT_MESSAGE "Memory limit exceeded"
+#define WREN_TIME_LIMIT_MESSAGE "Time limit exceeded"
+#define WREN_STEP_LIMIT_MESSAGE "Step limit exceeded"
+
+/*
+ * How many calls and loop iterations a VM runs between checks of its
+ * request's time and step limits.
+ */
+#define WREN_INTERRUPT_PERIOD 1024
+
+/*
+ * The encodings cached output is kept in, in order of preference.
+ */
+typedef enum {
+	WREN_ENCODING_IDENTITY,
+	WREN_ENCODING_GZIP,
+	WREN_ENCODING_BROTLI,
+	WREN_NUM_ENCODINGS
+} WrenEncoding;
+
+static const char *wren_encoding_names[WREN_NUM_ENCODINGS] = {
+	"identity", "gzip", "br"
+};
+
+/* Output smaller than this isn't worth compressing. */
+#define WREN_COMPRESS_MIN 256
+
+/* Middling levels, as pages are compressed while their request waits. */
+#define WREN_GZIP_LEVEL 6
+#define WREN_BROTLI_QUALITY 5
+
+/**
+ * A page's output in ModWrenOutputCache, with everything needed to send it
+ * again. Each entry has its own pool, destroyed once the entry has been
+ * evicted and the last request sending it is done.
+ */
+typedef struct {
+	apr_pool_t *pool;
+	const char *key;
+	apr_time_t expires;
+	const char *content_type;
+	apr_table_t *headers;
+	struct {
+		const char *data; /* NULL if this encoding isn't any smaller. */
+		apr_size_t len;
+	} bodies[WREN_NUM_ENCODINGS];
+	apr_size_t size; /* Bytes counted against ModWrenOutputCacheSize. */
+	int refs;
+	bool evicted;
+} WrenCachedOutput;
+
+#define WREN_OUTPUT_CACHE_SIZE_DEFAULT (16 * 1024 * 1024)
+
+/*
+ * Set by ModWrenOutputCacheSize. The most each child keeps in its output
+ * cache, counting every encoding.
+ */
+static size_t wren_output_cache_size = WREN_OUTPUT_CACHE_SIZE_DEFAULT;
+
+/* Each child's output cache, keyed on host and URL. */
+static apr_pool_t *wren_output_cache_pool;
+static apr_hash_t *wren_output_cache;
+static apr_size_t wren_output_cache_bytes;
+static pthread_mutex_t wren_output_cache_lock;
+
+/*
+ * Set by the ModWrenCompileCache directive. Compiled pages are kept here so
+ * that children can load them instead of compiling. NULL to always compile.
+ */
+static const char *wren_cache_dir;
+
+/*
+ * Identifies the build of Wren, including its patches, so cached code is
+ * only ever loaded by the Wren that compiled it. Set by the Makefile.
+ */
+#define WREN_STRINGIFY_(x) #x
+#define WREN_STRINGIFY(x) WREN_STRINGIFY_(x)
+
+module AP_MODULE_DECLARE_DATA wren_module;
+
 /* Set by the ModWrenLogging directive. */
 static bool wren_error_logging = true;
 
+/*
+ * Extensions loaded by the ModWrenExtension directive, keyed by the name
+ * they're imported with.
+ */
+static apr_hash_t *wren_extensions;
+
+/*
+ * Foreign methods and classes for "main" and every extension, keyed by
+ * wren_binding_key().
+ */
+#define WREN_BINDING_KEY_MAX 256
+static apr_hash_t *wren_foreign_methods;
+static apr_hash_t *wren_foreign_classes;
+
+/*
+ * Metrics shown by the wren-status handler. They live in shared memory
+ * created before the children fork, so every child adds to the same counters.
+ */
+
+/* Upper bounds of the latency histogram buckets, in microseconds. */
+static const apr_uint64_t wren_histogram_bounds[] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 1000000, 5000000
+};
+
+#define WREN_HISTOGRAM_BUCKETS \
+	(sizeof(wren_histogram_bounds) / sizeof(wren_histogram_bounds[0]))
+
+typedef struct {
+	apr_uint64_t count;
+	apr_uint64_t sum; /* Microseconds. */
+	apr_uint64_t buckets[WREN_HISTOGRAM_BUCKETS + 1]; /* The last is +Inf. */
+} WrenHistogram;
+
+/* The parts of a request we time. */
+typedef enum {
+	WREN_PHASE_ACQUIRE, /* Waiting for a free VM. */
+	WREN_PHASE_PARSE,   /* Reading and translating the page. */
+	WREN_PHASE_COMPILE,
+	WREN_PHASE_EXECUTE,
+	WREN_PHASE_RELEASE, /* Resetting the VM, including the collection. */
+	WREN_PHASE_GC,
+	WREN_PHASE_DB,      /* Each WebDB statement. */
+	WREN_PHASE_DEFER,   /* Web.defer() work, after the response. */
+	WREN_NUM_PHASES
+} WrenPhase;
+
+static const char *wren_phase_names[WREN_NUM_PHASES] = {
+	"acquire", "parse", "compile", "execute", "release", "gc", "db", "defer"
+};
+
+/* The part of the metrics kept for each pool. */
+typedef struct {
+	apr_uint64_t requests;
+	apr_uint64_t rejected;
+	apr_int64_t vms;
+	apr_int64_t vms_busy;
+	apr_int64_t waiting;
+} WrenPoolMetrics;
+
+typedef struct {
+	apr_uint64_t requests;
+	apr_uint64_t errors;  /* Pages that failed to compile or run. */
+	apr_uint64_t aborted; /* Pages stopped for going over a limit. */
+	apr_uint64_t rejected; /* Turned away by ModWrenQueueMax or Timeout. */
+	apr_uint64_t vms_recreated;
+	apr_uint64_t vms_trimmed; /* Destroyed after ModWrenPoolIdleTimeout. */
+	apr_int64_t vms;      /* VMs across all children. */
+	apr_int64_t vms_busy;
+	apr_int64_t heap_bytes;
+	apr_uint64_t compile_cache_hits; /* Pages loaded from ModWrenCompileCache. */
+	apr_uint64_t compile_cache_misses;
+	apr_uint64_t output_cache_hits; /* Pages sent from ModWrenOutputCache. */
+	apr_uint64_t output_cache_misses;
+	WrenHistogram phases[WREN_NUM_PHASES];
+	WrenPoolMetrics pools[WREN_POOLS_MAX];
+} WrenMetrics;
+
+/* The counters and gauges in WrenMetrics, in the order wren-status lists them. */
+static const struct {
+	const char *name;
+	size_t offset;
+	bool gauge;
+} wren_metric_values[] = {
+	{ "requests", offsetof(WrenMetrics, requests), false },
+	{ "errors", offsetof(WrenMetrics, errors), false },
+	{ "aborted", offsetof(WrenMetrics, aborted), false },
+	{ "rejected", offsetof(WrenMetrics, rejected), false },
+	{ "vms_recreated", offsetof(WrenMetrics, vms_recreated), false },
+	{ "vms_trimmed", offsetof(WrenMetrics, vms_trimmed), false },
+	{ "vms", offsetof(WrenMetrics, vms), true },
+	{ "vms_busy", offsetof(WrenMetrics, vms_busy), true },
+	{ "heap_bytes", offsetof(WrenMetrics, heap_bytes), true },
+	{ "compile_cache_hits", offsetof(WrenMetrics, compile_cache_hits), false },
+	{ "compile_cache_misses", offsetof(WrenMetrics, compile_cache_misses),
+		false },
+	{ "output_cache_hits", offsetof(WrenMetrics, output_cache_hits), false },
+	{ "output_cache_misses", offsetof(WrenMetrics, output_cache_misses),
+		false },
+};
+
+#define WREN_NUM_METRIC_VALUES \
+	(sizeof(wren_metric_values) / sizeof(wren_metric_values[0]))
+
+/* The same for each pool's WrenPoolMetrics. */
+static const struct {
+	const char *name;
+	size_t offset;
+	bool gauge;
+} wren_pool_metric_values[] = {
+	{ "requests", offsetof(WrenPoolMetrics, requests), false },
+	{ "rejected", offsetof(WrenPoolMetrics, rejected), false },
+	{ "vms", offsetof(WrenPoolMetrics, vms), true },
+	{ "vms_busy", offsetof(WrenPoolMetrics, vms_busy), true },
+	{ "waiting", offsetof(WrenPoolMetrics, waiting), true },
+};
+
+#define WREN_NUM_POOL_METRIC_VALUES \
+	(sizeof(wren_pool_metric_values) / sizeof(wren_pool_metric_values[0]))
+
+/* NULL if the shared memory couldn't be created. */
+static WrenMetrics *wren_metrics;
+
+#define WREN_METRICS_SHM_FILE "mod_wren_metrics.shm"
+
+/**
+ * Adds to a metric, named by its field in WrenMetrics, if there's shared
+ * memory for them. Its address is only taken once wren_metrics is known to be
+ * there.
+ */
+#define WREN_METRIC_ADD(field, value) do { \
+	if(wren_metrics != NULL) \
+		__atomic_fetch_add(&wren_metrics->field, (value), __ATOMIC_RELAXED); \
+} while(0)
+
+/**
+ * Records how long a phase of a request took.
+ */
+static void wren_metric_observe(WrenPhase phase, apr_interval_time_t time)
+{
+	WrenHistogram *histogram;
+	size_t bucket = 0;
+
+	if(wren_metrics == NULL)
+		return;
+
+	histogram = &wren_metrics->phases[phase];
+
+	while(bucket < WREN_HISTOGRAM_BUCKETS &&
+			(apr_uint64_t)time > wren_histogram_bounds[bucket])
+		++bucket;
+
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, time, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts VMs created in, or destroyed from, a pool.
+ */
+static void wren_metric_vms(WrenPool *pool, apr_int64_t value)
+{
+	WREN_METRIC_ADD(vms, value);
+	WREN_METRIC_ADD(pools[pool->index].vms, value);
+}
+
+/**
+ * Counts a pool's VMs being taken for, or given up by, a request.
+ */
+static void wren_metric_busy(WrenPool *pool, apr_int64_t value)
+{
+	WREN_METRIC_ADD(vms_busy, value);
+	WREN_METRIC_ADD(pools[pool->index].vms_busy, value);
+}
+
+/**
+ * A timed part of a single request, kept when ModWrenTiming is on or
+ * ModWrenSlowLog is set. These make up the Server-Timing header, the span log
+ * and the slow log.
+ */
+typedef struct {
+	WrenPhase phase;
+	apr_time_t start;
+	apr_time_t end;
+	const char *sql; /* Fingerprint of a WebDB statement, or NULL. */
+	bool failed;
+} WrenSpan;
+
+/* Set by the ModWrenSpanLog directive, and opened in wren_post_config(). */
+static const char *wren_span_log_path;
+static apr_file_t *wren_span_log;
+
+/*
+ * A profiled request's samples of its call stack: the microseconds spent in
+ * each stack, keyed by the stack in the collapsed format of flame graph tools.
+ */
+typedef struct WrenProfile {
+	apr_hash_t *stacks;
+	const char *root; /* The outermost frame, naming the page. */
+	apr_time_t last; /* When the last sample was taken. */
+	volatile bool due; /* Set by the profiler thread when it's time to sample. */
+} WrenProfile;
+
+/* Set by ModWrenProfileLog, and opened in wren_post_config(). */
+static const char *wren_profile_log_path;
+static apr_file_t *wren_profile_log;
+
+/*
+ * Set by ModWrenProfileSecret. Requests sending it in WREN_PROFILE_HEADER
+ * are profiled wherever they are.
+ */
+static const char *wren_profile_secret;
+
+#define WREN_PROFILE_HEADER "X-Wren-Profile"
+
+/* Microseconds between samples, and the deepest stack sampled. */
+#define WREN_PROFILE_INTERVAL 1000
+#define WREN_PROFILE_DEPTH 64
+#define WREN_PROFILE_STACK_MAX 4096
+
+/*
+ * The thread that has profiled requests sampled every WREN_PROFILE_INTERVAL,
+ * how child exit stops it, and how many requests it's sampling.
+ */
+static pthread_t wren_profile_thread;
+static pthread_cond_t wren_profile_cond;
+static bool wren_profile_running;
+static bool wren_profile_stop;
+static int wren_profiled;
+
+/*
+ * What the slow log needs of a request beyond its spans. The line is where
+ * the page was running at the first interrupt after it became slow, or the
+ * one that made the query it became slow in.
+ */
+typedef struct WrenSlow {
+	apr_time_t at; /* When the request becomes slow. */
+	const char *pool; /* The name of the pool its VM came from. */
+	size_t heap_before; /* The VM's heap when the request took it... */
+	size_t heap_after; /* ...and when it gave it back, before collecting. */
+	const char *module; /* NULL until the line is caught. */
+	const char *function;
+	int line;
+} WrenSlow;
+
+/* Set by ModWrenSlowLog, and opened in wren_post_config(). */
+static apr_interval_time_t wren_slow_log_threshold;
+static const char *wren_slow_log_path;
+static apr_file_t *wren_slow_log;
+
+/**
+ * Reduces a SQL statement to its shape, so the same query run with different
+ * values groups together: string and number literals become '?', and runs of
+ * whitespace become a single space.
+ */
+static const char* wren_sql_fingerprint(apr_pool_t *pool, const char *sql)
+{
+	char *out = apr_palloc(pool, strlen(sql) + 1);
+	char *o = out;
+	const char *c = sql;
+
+	while(*c != '\0') {
+		if(*c == '\'') {
+			/* Skip to the closing quote, stepping over '' escapes. */
+			for(++c; *c != '\0'; ++c) {
+				if(*c == '\'' && *++c != '\'')
+					break;
+			}
+
+			*o++ = '?';
+		} else if(apr_isdigit(*c) && (o == out ||
+					!(apr_isalnum(o[-1]) || o[-1] == '_')))
+		{
+			while(apr_isalnum(*c) || *c == '.')
+				++c;
+
+			*o++ = '?';
+		} else if(apr_isspace(*c)) {
+			while(apr_isspace(*c))
+				++c;
+
+			if(o != out && *c != '\0')
+				*o++ = ' ';
+		} else {
+			*o++ = *c++;
+		}
+	}
+
+	*o = '\0';
+
+	return out;
+}
+
+/**
+ * Records a part of the request that ran from 'start' to 'end' in the metrics
+ * and, when spans are kept, its spans. Returns the end time.
+ */
+static apr_time_t wren_record_span(apr_array_header_t *spans,
+		WrenPhase phase, apr_time_t start, apr_time_t end, const char *sql,
+		bool failed)
+{
+	wren_metric_observe(phase, end - start);
+
+	if(spans != NULL) {
+		WrenSpan *span = apr_array_push(spans);
+
+		span->phase = phase;
+		span->start = start;
+		span->end = end;
+		span->sql = sql != NULL ? wren_sql_fingerprint(spans->pool, sql) : NULL;
+		span->failed = failed;
+	}
+
+	return end;
+}
+
+/**
+ * Records a timed part of the request that has just finished. Returns the end
+ * time, for the next phase to start from.
+ */
+static apr_time_t wren_record_phase(apr_array_header_t *spans,
+		WrenPhase phase, apr_time_t start, const char *sql, bool failed)
+{
+	return wren_record_span(spans, phase, start, apr_time_now(), sql, failed);
+}
+
 #define ERROR_START \
 	"<div style='display: inline-block; width: 100%%; " \
 		"background-color: #E0E0E0;'>"
@@ -77,7 +799,20 @@ static bool wren_error_logging = true;
 static void wren_write(WrenVM *vm, const char *str)
 {
 	WrenState *wren_state = wrenGetUserData(vm);
-	ap_rprintf(wren_state->request_rec, "%s", str);
+
+	if(wren_state->output != NULL)
+		apr_brigade_puts(wren_state->output, NULL, NULL, str);
+	else
+		ap_rputs(str, wren_state->request_rec);
+}
+
+/**
+ * Turns a line number from Wren into the page's own. Pages are compiled
+ * wrapped in the "{\n" that translate_page() starts them with.
+ */
+static int wren_page_line(int line)
+{
+	return line > 0 ? line - 1 : line;
 }
 
 static void wren_err(WrenVM *vm, WrenErrorType type, const char *module,
@@ -97,15 +832,47 @@ static void wren_err(WrenVM *vm, WrenErrorType type, const char *module,
 
 	bool display_module_name = module != NULL && strcmp(module, "main") != 0;
 
-	ap_rprintf(wren_state->request_rec,
+	wren_write(vm, apr_psprintf(wren_state->request_rec->pool,
 			ERROR_START
 			"<p><b>%s%sine %d: </b>" /* line number */
 			"%s</p>" /* error message */
 			ERROR_END,
 			display_module_name == true ? module : "",
 			display_module_name == true ? ": l" : "L",
-			line > 0 ? line - 1 : line, message
-		);
+			wren_page_line(line), message
+		));
+}
+
+/**
+ * Notes the line a slow request is running. Called from the interrupt
+ * handler, or as a query finishes, so it only reads the VM. The names are
+ * copied, as the VM's go when its modules are unloaded.
+ */
+static void wren_slow_catch_line(WrenState *wren_state)
+{
+	WrenSlow *slow = wren_state->slow;
+	apr_pool_t *pool = wren_state->request_rec->pool;
+	WrenStackFrame frame;
+
+	/* Nothing but the core module is running; try again next time. */
+	if(wrenGetCallStack(wren_state->vm, &frame, 1) == 0)
+		return;
+
+	slow->module = apr_pstrdup(pool, frame.module);
+	slow->function = apr_pstrdup(pool, frame.function);
+	slow->line = wren_page_line(frame.line);
+}
+
+/**
+ * Catches the line a request is on, if it has become slow and it hasn't been
+ * caught yet.
+ */
+static void wren_slow_check(WrenState *wren_state)
+{
+	WrenSlow *slow = wren_state->slow;
+
+	if(slow != NULL && slow->module == NULL && apr_time_now() >= slow->at)
+		wren_slow_catch_line(wren_state);
 }
 
 /**
@@ -159,6 +926,8 @@ static void db_open(WrenState *wren_state, DatabaseConn *db,
 		db->error = error;
 		return;
 	}
+
+	db->params = apr_pstrdup(pool, params);
 }
 
 /**
@@ -172,8 +941,12 @@ static void db_close(DatabaseConn *db)
 	if(apr_dbd_close(db->driver, db->handle) != APR_SUCCESS)
 		db->error = "Failed to close database connection"; /* ¯\_(ツ)_/¯ */
 
+	for(int i = 0; db->spares != NULL && i < db->spares->nelts; ++i)
+		apr_dbd_close(db->driver, APR_ARRAY_IDX(db->spares, i, apr_dbd_t*));
+
 	db->driver = 0;
 	db->handle = 0;
+	db->spares = NULL;
 	apr_pool_clear(db->pool); /* Destroys sub-pools that mod_dbd might make. */
 	apr_pool_destroy(db->pool);
 	db->alive = false;
@@ -277,7 +1050,12 @@ static void wren_foreign_webdb_run(WrenVM *vm)
 	}
 
 	run = wrenGetSlotString(vm, 1);
+
+	apr_time_t start = apr_time_now();
 	result = apr_dbd_query(db->driver, db->handle, &rows, run);
+	wren_record_phase(wren_state->spans, WREN_PHASE_DB, start, run,
+			result != APR_SUCCESS);
+	wren_slow_check(wren_state);
 
 	if(result != APR_SUCCESS)
 		db->error = apr_dbd_error(db->driver, db->handle, result);
@@ -286,95 +1064,427 @@ static void wren_foreign_webdb_run(WrenVM *vm)
 }
 
 /**
- * WebDB.query()
+ * Runs a query, recording its span. Returns NULL and sets db->error if it
+ * fails. Doesn't touch the VM, so it can run while other requests use it.
  *
- * Runs a database query and returns a list of results, containing a list for
- * each table row returned. For example:
- *
- *   db.query("select Name,Age,FavouriteFood from PersonTable;")
- *
- * If the PersonTable contains two rows, the return value would be a list
- * containing two lists:
- *
- *   [
- *     [ "Eloise", "18", "Spinach" ]
- *     [ "Miranda", "25", "Chocolate" ]
- *   ]
+ * We request the database results synchronously (allowing random access to
+ * any row) so that we can get the numbers of rows with apr_dbd_num_tuples.
+ * This is slower than getting them asynchronously, but the list can then be
+ * made the right size up front.
  */
-static void wren_foreign_webdb_query(WrenVM *vm)
+static apr_dbd_results_t* wren_db_select(DatabaseConn *db, const char *query,
+		apr_array_header_t *spans)
 {
-	WrenState *wren_state = wrenGetUserData(vm);
-	request_rec *r = wren_state->request_rec;
-	DatabaseConn *db = (DatabaseConn*)wrenGetSlotForeign(vm, 0);
-
-	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING) {
-		db->error = "Type error in db.query(): must provide a string.";
-		wrenSetSlotNull(vm, 0);
-		return;
-	}
-
-	if(db->alive == false) {
-		wrenSetSlotNull(vm, 0);
-		return;
-	}
-
 	apr_dbd_results_t *results = NULL;
-	apr_dbd_row_t *apr_row = NULL;
-	const char *query = wrenGetSlotString(vm, 1);
 	int select_result;
-	int cols;
-	int rows;
-	int slot = 0;
 
-	/*
-	 * We request the database results synchronously (allowing random access to
-	 * any row) so that we can get the numbers of rows with apr_dbd_num_tuples.
-	 * This is slower than getting them asynchronously, but we need the number
-	 * of rows so that we can request enough slots from Wren.
-	 */
-	if((select_result = apr_dbd_select(db->driver, db->pool, db->handle,
-				&results, query, -1) != APR_SUCCESS) || results == NULL)
-	{
+	apr_time_t start = apr_time_now();
+	select_result = apr_dbd_select(db->driver, db->pool, db->handle,
+			&results, query, -1);
+	wren_record_phase(spans, WREN_PHASE_DB, start, query,
+			select_result != APR_SUCCESS);
+
+	if(select_result != APR_SUCCESS || results == NULL) {
 		db->error = apr_dbd_error(db->driver, db->handle, select_result);
-		wrenSetSlotNull(vm, 0);
-		return;
+		return NULL;
 	}
 
-	rows = apr_dbd_num_tuples(db->driver, results);
-	cols = apr_dbd_num_cols(db->driver, results);
+	return results;
+}
 
-	/*
-	 * Reserve the number of table, elements, plus a list to hold each row,
-	 * plus the big list we're returning in slot 0.
-	 */
-	wrenEnsureSlots(vm, rows * cols + rows + 1);
-	wrenSetSlotNewList(vm, slot++);
+/**
+ * Stores query results in 'slot' as a list of rows, each a list of columns.
+ * The slot after it is used to build each row, so two slots do for any size
+ * of result.
+ */
+static void wren_db_results_to_list(WrenState *wren_state, DatabaseConn *db,
+		apr_dbd_results_t *results, int slot)
+{
+	WrenVM *vm = wren_state->vm;
+	apr_dbd_row_t *apr_row = NULL;
+	int rows = apr_dbd_num_tuples(db->driver, results);
+	int cols = apr_dbd_num_cols(db->driver, results);
+	const char **entries = apr_palloc(wren_state->request_rec->pool,
+			sizeof(const char*) * MAX(cols, 1));
 
-	/*
-	 * For each row, create a new list and insert the value of each column.
-	 */
-	for(int row = 1;
-			apr_dbd_get_row(db->driver, r->pool, results, &apr_row, row) != -1;
+	wrenSetSlotNewListWithCapacity(vm, slot, rows);
+
+	for(int row = 1; apr_dbd_get_row(db->driver,
+				wren_state->request_rec->pool, results, &apr_row, row) != -1;
 			++row)
 	{
-		int list_slot = slot++;
-
-		wrenSetSlotNewList(vm, list_slot);
+		for(int col = 0; col < cols; ++col)
+			entries[col] = apr_dbd_get_entry(db->driver, apr_row, col);
 
-		for(int col = 0; col < cols; ++col) {
-			const char *entry = apr_dbd_get_entry(db->driver, apr_row, col);
-			int entry_slot = slot++;
+		wrenSetSlotNewListWithCapacity(vm, slot + 1, cols);
+		wrenAppendStringsToList(vm, slot + 1, entries, cols);
+		wrenInsertInList(vm, slot, -1, slot + 1);
+	}
+}
+
+/**
+ * Gives a query in a batch a handle on its connection: the connection's own
+ * handle for the first query on it, and a spare for each one after, opened
+ * the first time it's needed. Spares stay open until the connection closes,
+ * for the next batch to reuse.
+ */
+static apr_dbd_t* wren_db_claim(DatabaseConn *db, const char **error)
+{
+	apr_dbd_t *handle;
+
+	if(db->claimed == 0) {
+		++db->claimed;
+		return db->handle;
+	}
+
+	if(db->spares == NULL)
+		db->spares = apr_array_make(db->pool, 4, sizeof(apr_dbd_t*));
+
+	if(db->claimed > db->spares->nelts) {
+		if(apr_dbd_open_ex(db->driver, db->pool, db->params, &handle,
+					error) != APR_SUCCESS)
+			return NULL;
+
+		APR_ARRAY_PUSH(db->spares, apr_dbd_t*) = handle;
+	}
+
+	return APR_ARRAY_IDX(db->spares, db->claimed++ - 1, apr_dbd_t*);
+}
+
+/**
+ * Makes a pool for a query to run in on a thread of its own. It has its own
+ * allocator too, since the request's isn't safe to share between threads.
+ */
+static apr_pool_t* wren_db_query_pool(apr_pool_t *parent)
+{
+	apr_allocator_t *allocator;
+	apr_pool_t *pool;
+
+	if(apr_allocator_create(&allocator) != APR_SUCCESS)
+		return NULL;
+
+	if(apr_pool_create_ex(&pool, parent, NULL, allocator) != APR_SUCCESS) {
+		apr_allocator_destroy(allocator);
+		return NULL;
+	}
+
+	apr_allocator_owner_set(allocator, pool);
+
+	return pool;
+}
+
+/**
+ * Runs one query of a batch, on whichever thread it's been given.
+ */
+static void* wren_db_query_main(void *data)
+{
+	WrenQuery *query = (WrenQuery*)data;
+	const apr_dbd_driver_t *driver = query->db->driver;
+	int status;
+
+	query->start = apr_time_now();
+	status = apr_dbd_select(driver, query->pool, query->handle,
+			&query->results, query->query, -1);
+	query->end = apr_time_now();
+
+	if(status != APR_SUCCESS || query->results == NULL) {
+		query->results = NULL;
+		query->error = apr_pstrdup(query->pool,
+				apr_dbd_error(driver, query->handle, status));
+	}
+
+	return NULL;
+}
+
+/**
+ * Whether a driver's connections can be used from a thread of their own with
+ * no setup. The MySQL client wants mysql_thread_init() on every thread that
+ * uses it, which apr_dbd only does for the thread that loaded the driver, and
+ * the others are untested, so only these run queries side by side.
+ */
+static bool wren_db_threadable(const apr_dbd_driver_t *driver)
+{
+	const char *name = apr_dbd_name(driver);
+
+	return strcmp(name, "pgsql") == 0 || strcmp(name, "sqlite3") == 0;
+}
+
+/**
+ * Runs a batch of queries side by side, so it takes as long as the slowest
+ * of them rather than all of them added up. Each query past the first has a
+ * thread to itself, up to WREN_PARALLEL_QUERIES_MAX at once, if its driver
+ * allows it; the rest run one after the other. Errors are copied into 'pool'
+ * for WebDB.error. Like wren_db_select(), doesn't touch the VM.
+ */
+static void wren_db_run_batch(apr_array_header_t *queries,
+		apr_array_header_t *spans, apr_pool_t *pool)
+{
+	WrenQuery *batch = (WrenQuery*)queries->elts;
+
+	for(int wave = 0; wave < queries->nelts;
+			wave += WREN_PARALLEL_QUERIES_MAX)
+	{
+		int end = MIN(wave + WREN_PARALLEL_QUERIES_MAX, queries->nelts);
+		bool first = true;
+
+		for(int i = wave; i < end; ++i) {
+			WrenQuery *query = &batch[i];
+			const char *error = "Failed to create a pool for the query";
+
+			if(query->db->alive == false) {
+				query->error = query->db->error ?:
+					"The database connection isn't open";
+				continue;
+			}
+
+			if((query->handle = wren_db_claim(query->db, &error)) == NULL ||
+					(query->pool = wren_db_query_pool(query->db->pool)) == NULL)
+			{
+				query->handle = NULL;
+				query->error = error;
+				continue;
+			}
+
+			/* The first runs here, once the others are under way. */
+			if(first == true)
+				first = false;
+			else if(wren_db_threadable(query->db->driver))
+				query->threaded = pthread_create(&query->thread, NULL,
+						wren_db_query_main, query) == 0;
+		}
+
+		for(int i = wave; i < end; ++i) {
+			if(batch[i].handle != NULL && batch[i].threaded == false)
+				wren_db_query_main(&batch[i]);
+		}
+
+		for(int i = wave; i < end; ++i) {
+			WrenQuery *query = &batch[i];
+
+			if(query->threaded == true)
+				pthread_join(query->thread, NULL);
+
+			query->db->claimed = 0;
+
+			if(query->handle != NULL)
+				wren_record_span(spans, WREN_PHASE_DB, query->start,
+						query->end, query->query, query->results == NULL);
+
+			if(query->error != NULL)
+				query->db->error = apr_pstrdup(pool, query->error);
+		}
+	}
+}
+
+/**
+ * Stores a batch's results in 'slot' as a list of each query's rows, in
+ * order, or null for those that failed. The two slots after it are used to
+ * build them. The pools the results were in are freed.
+ */
+static void wren_db_batch_to_list(WrenState *wren_state,
+		apr_array_header_t *queries, int slot)
+{
+	WrenVM *vm = wren_state->vm;
+
+	wrenSetSlotNewListWithCapacity(vm, slot, queries->nelts);
+
+	for(int i = 0; i < queries->nelts; ++i) {
+		WrenQuery *query = &APR_ARRAY_IDX(queries, i, WrenQuery);
+
+		if(query->results != NULL)
+			wren_db_results_to_list(wren_state, query->db, query->results,
+					slot + 1);
+		else
+			wrenSetSlotNull(vm, slot + 1);
+
+		wrenInsertInList(vm, slot, -1, slot + 1);
+
+		if(query->pool != NULL)
+			apr_pool_destroy(query->pool);
+	}
+}
+
+/**
+ * Reads a batch from a list of WebDBs in 'slot' and a list of the queries to
+ * run on them in the slot after, using the two slots after that. Returns NULL
+ * if they aren't lists of the same length, and aborts the fiber as well if
+ * anything but a WebDB is in the first.
+ */
+static apr_array_header_t* wren_db_read_batch(WrenVM *vm, int slot,
+		apr_pool_t *pool)
+{
+	apr_array_header_t *queries;
+	int count;
+
+	if(wrenGetSlotType(vm, slot) != WREN_TYPE_LIST ||
+			wrenGetSlotType(vm, slot + 1) != WREN_TYPE_LIST ||
+			(count = wrenGetListCount(vm, slot)) !=
+			wrenGetListCount(vm, slot + 1))
+		return NULL;
+
+	queries = apr_array_make(pool, MAX(count, 1), sizeof(WrenQuery));
+	wrenGetVariable(vm, "main", "WebDB", slot + 3);
 
-			if(entry != NULL)
-				wrenSetSlotString(vm, entry_slot, entry);
-			else
-				wrenSetSlotNull(vm, entry_slot);
+	for(int i = 0; i < count; ++i) {
+		WrenQuery *query = apr_array_push(queries);
 
-			wrenInsertInList(vm, list_slot, -1, entry_slot);
+		memset(query, 0x0, sizeof(WrenQuery));
+
+		/*
+		 * Pages can call the foreign methods that batches come through, so
+		 * anything else in here would have its bytes taken for a connection.
+		 */
+		wrenGetListElement(vm, slot, i, slot + 2);
+		if(wrenGetSlotType(vm, slot + 2) != WREN_TYPE_FOREIGN ||
+				wrenGetSlotIsInstance(vm, slot + 2, slot + 3) == false)
+		{
+			wrenSetSlotString(vm, slot + 2,
+					"Batches can only run queries on WebDB connections");
+			wrenAbortFiber(vm, slot + 2);
+			return NULL;
 		}
+		query->db = (DatabaseConn*)wrenGetSlotForeign(vm, slot + 2);
+
+		wrenGetListElement(vm, slot + 1, i, slot + 2);
+		if(wrenGetSlotType(vm, slot + 2) != WREN_TYPE_STRING)
+			return NULL;
+		query->query = apr_pstrdup(pool, wrenGetSlotString(vm, slot + 2));
+	}
+
+	return queries;
+}
+
+/**
+ * WebDB.query()
+ *
+ * Runs a database query and returns a list of results, containing a list for
+ * each table row returned. For example:
+ *
+ *   db.query("select Name,Age,FavouriteFood from PersonTable;")
+ *
+ * If the PersonTable contains two rows, the return value would be a list
+ * containing two lists:
+ *
+ *   [
+ *     [ "Eloise", "18", "Spinach" ]
+ *     [ "Miranda", "25", "Chocolate" ]
+ *   ]
+ */
+static void wren_foreign_webdb_query(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	DatabaseConn *db = (DatabaseConn*)wrenGetSlotForeign(vm, 0);
+
+	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING) {
+		db->error = "Type error in db.query(): must provide a string.";
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	if(db->alive == false) {
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	apr_dbd_results_t *results = wren_db_select(db, wrenGetSlotString(vm, 1),
+			wren_state->spans);
+
+	wren_slow_check(wren_state);
 
-		wrenInsertInList(vm, 0, -1, list_slot);
+	if(results == NULL) {
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	wrenEnsureSlots(vm, 2);
+	wren_db_results_to_list(wren_state, db, results, 0);
+}
+
+/**
+ * WebDB.queryAll_(dbs, queries)
+ *
+ * Runs a batch of queries side by side, returning a list of their results in
+ * the same order. Used by Web.parallel() once every function in it is waiting
+ * on a query.
+ */
+static void wren_foreign_webdb_queryAll(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	apr_pool_t *pool = wren_state->request_rec->pool;
+	apr_array_header_t *queries;
+
+	wrenEnsureSlots(vm, 5);
+
+	if((queries = wren_db_read_batch(vm, 1, pool)) == NULL) {
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	wren_db_run_batch(queries, wren_state->spans, pool);
+	wren_slow_check(wren_state);
+	wren_db_batch_to_list(wren_state, queries, 0);
+}
+
+/**
+ * WebDB.queryAllAsync_(fiber, dbs, queries)
+ *
+ * With ModWrenAsyncDB on, sets a batch of queries aside to be run once the
+ * fiber has suspended itself, and returns true. Otherwise returns false, and
+ * WebDB.queryAll_() runs them there and then.
+ */
+static void wren_foreign_webdb_queryAllAsync(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	apr_array_header_t *queries;
+
+	wrenEnsureSlots(vm, 6);
+
+	if(wren_async_db == false || wren_state->pending_fiber != NULL ||
+			(queries = wren_db_read_batch(vm, 2,
+				wren_state->request_rec->pool)) == NULL)
+	{
+		wrenSetSlotBool(vm, 0, false);
+		return;
+	}
+
+	wren_state->pending_fiber = wrenGetSlotHandle(vm, 1);
+	wren_state->pending = queries;
+
+	wrenSetSlotBool(vm, 0, true);
+}
+
+/**
+ * db.queryAsync_(fiber, query)
+ *
+ * With ModWrenAsyncDB on, sets a query aside as a batch of one, to be run
+ * once the page's fiber has suspended itself, and returns true. Otherwise
+ * returns false, and db.query() runs it there and then.
+ */
+static void wren_foreign_webdb_queryAsync(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	DatabaseConn *db = (DatabaseConn*)wrenGetSlotForeign(vm, 0);
+
+	if(wren_async_db == false || wren_state->pending_fiber != NULL ||
+			wrenGetSlotType(vm, 2) != WREN_TYPE_STRING || db->alive == false)
+	{
+		wrenSetSlotBool(vm, 0, false);
+		return;
 	}
+
+	WrenQuery *query;
+
+	wren_state->pending_fiber = wrenGetSlotHandle(vm, 1);
+	wren_state->pending = apr_array_make(wren_state->request_rec->pool, 1,
+			sizeof(WrenQuery));
+
+	query = apr_array_push(wren_state->pending);
+	memset(query, 0x0, sizeof(WrenQuery));
+	query->db = db;
+	query->query = apr_pstrdup(wren_state->request_rec->pool,
+			wrenGetSlotString(vm, 2));
+
+	wrenSetSlotBool(vm, 0, true);
 }
 
 /**
@@ -434,27 +1544,28 @@ static void wren_foreign_webdb_clearError(WrenVM *vm)
 }
 
 /**
- * Inserts a provided array of headers into a Wren map at the specified 'slot'.
- *
- * Makes two assumptions:
- *   - There's a map to be written to at slot 0.
- *   - There are enough slots to write to.
- *
- * 'slots' gets incremented by the number of slots written to.
+ * Inserts a provided array of headers into the Wren map in slot 0, all in one
+ * call.
  */
 static void wren_headers_to_map(WrenState *wren_state,
-		const apr_array_header_t *headers, int *slot)
+		const apr_array_header_t *headers)
 {
-	WrenVM *vm = wren_state->vm;
+	apr_pool_t *pool = wren_state->request_rec->pool;
 	const apr_table_entry_t *e = (apr_table_entry_t*) headers->elts;
+	const char **keys, **values;
+
+	if(headers->nelts == 0)
+		return;
 
-	for(size_t i = 0; i < headers->nelts; ++i) {
-		wrenSetSlotString(vm, *slot, e[i].key);
-		wrenSetSlotString(vm, *slot + 1, e[i].val);
-		wrenInsertInMap(vm, 0, *slot, *slot + 1);
+	keys = apr_palloc(pool, sizeof(const char*) * headers->nelts);
+	values = apr_palloc(pool, sizeof(const char*) * headers->nelts);
 
-		*slot += 2;
+	for(int i = 0; i < headers->nelts; ++i) {
+		keys[i] = e[i].key;
+		values[i] = e[i].val;
 	}
+
+	wrenInsertStringsInMap(wren_state->vm, 0, keys, values, headers->nelts);
 }
 
 /**
@@ -469,24 +1580,21 @@ static void wren_fn_getEnv(WrenVM *vm)
 	const apr_array_header_t *req_headers = apr_table_elts(r->headers_in);
 	const apr_array_header_t *subprocess_env =
 		apr_table_elts(r->subprocess_env);
-	int slot = 0;
+	const char *method_key = "Request-Method";
 
-	/* Enough slots for a key value pair per headers, plus the map. */
-	wrenEnsureSlots(vm, (req_headers->nelts + subprocess_env->nelts) * 2 + 1);
-	wrenSetSlotNewMap(vm, slot++);
+	wren_state->personal = true;
 
-	wren_headers_to_map(wren_state, req_headers, &slot);
-	wren_headers_to_map(wren_state, subprocess_env, &slot);
+	/* Room for every header and variable, plus the request method. */
+	wrenSetSlotNewMapWithCapacity(vm, 0,
+			req_headers->nelts + subprocess_env->nelts + 1);
 
-	wrenSetSlotString(vm, slot, "Request-Method");
-	wrenSetSlotString(vm, slot + 1, r->method);
-	wrenInsertInMap(vm, 0, slot, slot + 1);
-	slot += 2;
+	wren_headers_to_map(wren_state, req_headers);
+	wren_headers_to_map(wren_state, subprocess_env);
+	wrenInsertStringsInMap(vm, 0, &method_key, &r->method, 1);
 }
 
 /**
- * Parse URL parameters and add them to a Wren map of key/value pairs, starting
- * at slot 0.
+ * Parse URL parameters into a Wren map of key/value pairs in slot 0.
  *
  * Map values will be strings unless multiple values were using the same key,
  * in which case it will be a list of strings.
@@ -496,57 +1604,20 @@ static void wren_parse_url_params(WrenState *wren_state, char *args)
 	WrenVM *vm = wren_state->vm;
 	request_rec *r = wren_state->request_rec;
 
-	/* We'll increment the number of slots we expect as we parse arguments. */
-	int num_args = 0;
-	int slot = 0;
-
-	wrenSetSlotNewMap(vm, slot++);
-
-	/* Count up the number of key value pairs. */
-	{
-		/* Assigned arguments come through as key1=val1&key2=val2.
-		 * If an ampersand is to the right of an equals sign, it's
-		 * an empty argument we don't have to worry about.
-		 */
-		char *ptr = args;
-		while((ptr = strchr(ptr, '=')) != NULL) {
-			++ptr;
-
-			if(*ptr != '&' && *ptr != '\0')
-				++num_args;
-		}
-	}
-
 	/*
-	 * We need enough slots for:
-	 *  - a key/value pair per key (num_args * 2)
-	 *  - every key potentially having two values, meaning three slots ( * 1.5)
-	 *  - the returned map ( + 1)
+	 * Values are grouped by key before anything goes to Wren, keeping the
+	 * keys in the order they first appear.
 	 */
-	wrenEnsureSlots(vm, num_args * 2 * 1.5 + 1);
+	apr_hash_t *values = apr_hash_make(r->pool);
+	apr_array_header_t *keys = apr_array_make(r->pool, 8, sizeof(const char*));
 
 	/*
 	 * Loop through each argument, separate the key/value pair, un-URIfy them,
-	 * and push them to the Wren map.
+	 * and group them by key.
 	 */
-
 	char *ptr = args;
 	char *key, *val;
 
-	/*
-	 * If we have a unique key it's stored as a string. If the key is reused
-	 * we store it as a list. So we have to keep track of the keys as we go
-	 * along, and where the values are currently stored.
-	 */
-	int unique_keys = 0;
-
-	struct {
-		const char *key;
-		bool is_list;
-		int slot; /* Value slot - the key slot will be this - 1 */
-	} keys[num_args];
-	memset(keys, 0x0, sizeof(keys));
-
 	while(*ptr && (val = ap_getword(r->pool, (const char**)&ptr, '&'))) {
 		key = ap_getword(r->pool, (const char**)&val, '=');
 
@@ -562,73 +1633,52 @@ static void wren_parse_url_params(WrenState *wren_state, char *args)
 		ap_unescape_url((char*)key);
 		ap_unescape_url((char*)val);
 
-		/*
-		 * Check for key reuse. If we have any duplicates, we store a List as
-		 * the value of our Map's key/value pair.
-		 */
-		bool duplicate_key = false;
-		for(size_t i = 0; i < unique_keys; ++i) {
-			if(strcmp(keys[i].key, key) != 0)
-				continue;
-
-			/*
-			 * First duplicate encounter - convert the value from string to
-			 * list.
-			 */
-			if(keys[i].is_list == false) {
-				const char *val_stored = wrenGetSlotString(vm, keys[i].slot);
-				int val_slot = slot++;
-
-				/*
-				 * Move the string over to a new slot - we're going to reuse our
-				 * original slot for the list.
-				 */
-				wrenSetSlotString(vm, val_slot, val_stored);
-
-				/*
-				 * Create a new list in the slot that is +1 past the map key and put
-				 * our existing string in there.
-				 */
-				wrenSetSlotNewList(vm, keys[i].slot);
-				wrenInsertInList(vm, keys[i].slot, -1, val_slot);
-				keys[i].is_list = true;
-			}
-
-			/* Insert the new string. */
-			int val_slot = slot++;
-			wrenSetSlotString(vm, val_slot, val);
-			wrenInsertInList(vm, keys[i].slot, -1, val_slot);
+		apr_array_header_t *key_values = apr_hash_get(values, key,
+				APR_HASH_KEY_STRING);
 
-			duplicate_key = true;
-			break;
+		if(key_values == NULL) {
+			key_values = apr_array_make(r->pool, 1, sizeof(const char*));
+			apr_hash_set(values, key, APR_HASH_KEY_STRING, key_values);
+			APR_ARRAY_PUSH(keys, const char*) = key;
 		}
 
-		if(duplicate_key == true)
-			continue;
-
-		/*
-		 * Otherwise, we've hit a unique key. Create a Map key/value entry and
-		 * insert it.
-		 */
-		wrenSetSlotString(vm, slot, key);
-		wrenSetSlotString(vm, slot + 1, val);
-		wrenInsertInMap(vm, 0, slot, slot + 1);
-
-		keys[unique_keys].key = key;
-		keys[unique_keys].slot = slot + 1;
-
-		++unique_keys;
-		slot += 2;
+		APR_ARRAY_PUSH(key_values, const char*) = val;
 	}
 
 	/*
-	 * If we converted any duplicate values from strings to lists, we have to
-	 * reinsert them into the map.
+	 * Keys with a single value all go into the map in one call at the end.
+	 * A reused key gets its values as a list, built in slot 1 and keyed by
+	 * slot 2.
 	 */
-	for(size_t i = 0; i < unique_keys; ++i) {
-		if(keys[i].is_list == true)
-			wrenInsertInMap(vm, 0, keys[i].slot - 1, keys[i].slot);
+	const char **single_keys = apr_palloc(r->pool,
+			sizeof(const char*) * MAX(keys->nelts, 1));
+	const char **single_values = apr_palloc(r->pool,
+			sizeof(const char*) * MAX(keys->nelts, 1));
+	int singles = 0;
+
+	wrenEnsureSlots(vm, 3);
+	wrenSetSlotNewMapWithCapacity(vm, 0, keys->nelts);
+
+	for(int i = 0; i < keys->nelts; ++i) {
+		const char *key = APR_ARRAY_IDX(keys, i, const char*);
+		apr_array_header_t *key_values = apr_hash_get(values, key,
+				APR_HASH_KEY_STRING);
+
+		if(key_values->nelts == 1) {
+			single_keys[singles] = key;
+			single_values[singles++] = APR_ARRAY_IDX(key_values, 0,
+					const char*);
+			continue;
+		}
+
+		wrenSetSlotNewListWithCapacity(vm, 1, key_values->nelts);
+		wrenAppendStringsToList(vm, 1, (const char**)key_values->elts,
+				key_values->nelts);
+		wrenSetSlotString(vm, 2, key);
+		wrenInsertInMap(vm, 0, 2, 1);
 	}
+
+	wrenInsertStringsInMap(vm, 0, single_keys, single_values, singles);
 }
 
 /**
@@ -691,787 +1741,4709 @@ static void wren_fn_parsePost(WrenVM *vm)
 }
 
 /**
- * Retrieve the cookie value for a provided key.
+ * Returns the cookies sent with the current request as a table of key/value
+ * pairs.
  *
- * Slot 1: Cookie name
+ * The Cookie header is only parsed the first time this is called for a
+ * request, so repeated lookups are a single table search.
  */
-static void wren_fn_getCookie(WrenVM *vm)
+static apr_table_t* wren_request_cookies(WrenState *wren_state)
 {
-	WrenState *wren_state = wrenGetUserData(vm);
 	request_rec *r = wren_state->request_rec;
-
-	const char *cookie_name = wrenGetSlotString(vm, 1);
-	const char *data = apr_table_get(r->headers_in, "cookie");
+	const char *data;
 	const char *pair;
 	const char *key;
-	const char *val;
 
-	if(cookie_name == NULL || data == NULL) {
-		wrenSetSlotNull(vm, 0);
-		return;
-	}
+	if(wren_state->cookies != NULL)
+		return wren_state->cookies;
+
+	wren_state->cookies = apr_table_make(r->pool, 8);
+
+	if((data = apr_table_get(r->headers_in, "cookie")) == NULL)
+		return wren_state->cookies;
 
-	/* Search through all the cookies set until we find the one we want. */
 	while(*data && (pair = ap_getword(r->pool, &data, ';'))) {
-		val = ap_getword(r->pool, (const char**)&pair, ';');
-		key = ap_getword(r->pool, (const char**)&val, '=');
+		key = ap_getword(r->pool, &pair, '=');
 
 		/* Convert encoded to the expected readable form. */
 		while(*key && (*key == ' ' || *key == '\t' || *key == '\r' || *key == '\n'))
 			key++;
 
-		if(strcmp(key, cookie_name) == 0) {
-			wrenSetSlotString(vm, 0, val);
-			return;
-		}
+		if(*key != '\0')
+			apr_table_addn(wren_state->cookies, key, pair);
 	}
+
+	return wren_state->cookies;
 }
 
 /**
- * Set a cookie.
+ * Retrieve the cookie value for a provided key.
  *
- * Slot 1: Cookie name (string)
- * Slot 2: Cookie value (string)
- * Slot 3: Expiration time in seconds (double)
- * Slot 4: Cookie path (string)
+ * Slot 1: Cookie name
  */
-static void wren_fn_setCookie(WrenVM *vm)
+static void wren_fn_getCookie(WrenVM *vm)
 {
 	WrenState *wren_state = wrenGetUserData(vm);
-	request_rec *r = wren_state->request_rec;
-
-	const char *cookie;
-	const char *name  = wrenGetSlotString(vm, 1);
-	const char *value = wrenGetSlotString(vm, 2);
-	int expires       = wrenGetSlotDouble(vm, 3);
-	const char *path  = wrenGetSlotString(vm, 4);
+	const char *val = NULL;
 
-	if(expires > 0) {
-		cookie = apr_psprintf(r->pool, "%s=%s; Max-Age=%u;Path=%s;",
-				name, value, expires, path);
-	}
-	else {
-		cookie = apr_psprintf(r->pool, "%s=%s; Path=%s;",
-				name, value, path);
+	if(wrenGetSlotType(vm, 1) == WREN_TYPE_STRING) {
+		val = apr_table_get(wren_request_cookies(wren_state),
+				wrenGetSlotString(vm, 1));
 	}
 
-	apr_table_set(r->headers_out, "Set-Cookie", cookie);
+	if(val != NULL)
+		wrenSetSlotString(vm, 0, val);
+	else
+		wrenSetSlotNull(vm, 0);
 }
 
 /**
- * Set the content type to be returned by the Wren handler on successful page
- * delivery.
+ * Request foreign class allocate.
+ *
+ * A Request carries no data of its own: every lookup reads straight from the
+ * request_rec of whichever request the VM is currently serving.
  */
-static void wren_fn_setContentType(WrenVM *vm)
+static void wren_foreign_request_allocate(WrenVM *vm)
 {
-	WrenState *wren_state = wrenGetUserData(vm);
+	wrenSetSlotNewForeign(vm, 0, 0, 0);
+}
+
+/**
+ * Sets slot 0 to the value of 'key' in 'table', or null if it isn't set.
+ */
+static void wren_table_lookup(WrenVM *vm, const apr_table_t *table)
+{
+	const char *val = NULL;
 
 	if(wrenGetSlotType(vm, 1) == WREN_TYPE_STRING)
-		wren_state->content_type = wrenGetSlotString(vm, 1);
+		val = apr_table_get(table, wrenGetSlotString(vm, 1));
+
+	if(val != NULL)
+		wrenSetSlotString(vm, 0, val);
+	else
+		wrenSetSlotNull(vm, 0);
 }
 
 /**
- * Set the content type to be returned by the Wren handler on successful page
- * delivery.
+ * Request.header()
  *
- * Slot 1/String: Header to write.
- * Slot 2/String: Value to assign to header.
+ * Returns the value of a single request header, or null if it wasn't sent.
  */
-static void wren_fn_setHeader(WrenVM *vm)
+static void wren_foreign_request_header(WrenVM *vm)
 {
 	WrenState *wren_state = wrenGetUserData(vm);
-	request_rec *r = wren_state->request_rec;
-
-	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING ||
-			wrenGetSlotType(vm, 2) != WREN_TYPE_STRING)
-		return;
 
-	apr_table_set(r->headers_out,
-			wrenGetSlotString(vm, 1), wrenGetSlotString(vm, 2));
+	wren_state->personal = true;
+	wren_table_lookup(vm, wren_state->request_rec->headers_in);
 }
 
 /**
- * Set the HTTP status code to be returned by the Wren handler on successful
- * page delivery.
+ * Request.env()
+ *
+ * Returns the value of a single environment variable, or null if it isn't
+ * set.
  */
-static void wren_fn_setStatusCode(WrenVM *vm)
+static void wren_foreign_request_env(WrenVM *vm)
 {
 	WrenState *wren_state = wrenGetUserData(vm);
 
-	if(wrenGetSlotType(vm, 1) == WREN_TYPE_NUM)
-		wren_state->status_code = wrenGetSlotDouble(vm, 1) + 0.5;
+	wren_state->personal = true;
+	wren_table_lookup(vm, wren_state->request_rec->subprocess_env);
 }
 
 /**
- * Set the HTTP return code to be invoke a server page response (e.g. a 404
- * error page).
+ * Request.cookie()
+ *
+ * Returns the value of a single cookie, or null if it wasn't sent.
  */
-static void wren_fn_setReturnCode(WrenVM *vm)
+static void wren_foreign_request_cookie(WrenVM *vm)
 {
 	WrenState *wren_state = wrenGetUserData(vm);
 
-	if(wrenGetSlotType(vm, 1) == WREN_TYPE_NUM)
-		wren_state->return_code = wrenGetSlotDouble(vm, 1) + 0.5;
+	wren_table_lookup(vm, wren_request_cookies(wren_state));
 }
 
 /**
- * Maps foreign method signatures to functions. We receive a signature of a
- * function inside a class, inside a module, and see if we have something that
- * maps up.
+ * Request.method
  *
- * We currently only bind things inside the "main" module.
+ * Getter for the request method, e.g. "GET" or "POST".
  */
-static WrenForeignMethodFn wren_bind_foreign_method(WrenVM *vm,
-		const char *module, const char *class_name, bool is_static,
-		const char *signature)
+static void wren_foreign_request_method(WrenVM *vm)
 {
-	if(strcmp(module, "main") == 0) {
-		if(strcmp(class_name, "Web") == 0) {
-			if(is_static == true) {
-				if(strcmp(signature, "getCookie(_)") == 0)
-					return wren_fn_getCookie;
-				if(strcmp(signature, "setCookie(_,_,_,_)") == 0)
-					return wren_fn_setCookie;
-				if(strcmp(signature, "setContentType(_)") == 0)
-					return wren_fn_setContentType;
-				if(strcmp(signature, "setHeader(_,_)") == 0)
-					return wren_fn_setHeader;
-				if(strcmp(signature, "setReturnCode(_)") == 0)
-					return wren_fn_setReturnCode;
-				if(strcmp(signature, "setStatusCode(_)") == 0)
-					return wren_fn_setStatusCode;
-
-				if(strcmp(signature, "wrapped_getEnv()") == 0)
-					return wren_fn_getEnv;
-				if(strcmp(signature, "wrapped_parseGet()") == 0)
-					return wren_fn_parseGet;
-				if(strcmp(signature, "wrapped_parsePost()") == 0)
-					return wren_fn_parsePost;
-
-			}
-		}
-
-		if(strcmp(class_name, "WebDB") == 0) {
-			if(is_static == false) {
-				if(strcmp(signature, "init open(_)") == 0)
-					return wren_foreign_webdb_open;
-				if(strcmp(signature, "close()") == 0)
-					return wren_foreign_webdb_close;
-				if(strcmp(signature, "isAlive") == 0)
-					return wren_foreign_webdb_isAlive;
-				if(strcmp(signature, "run(_)") == 0)
-					return wren_foreign_webdb_run;
-				if(strcmp(signature, "escape(_)") == 0)
-					return wren_foreign_webdb_escape;
-				if(strcmp(signature, "error") == 0)
-					return wren_foreign_webdb_error;
-				if(strcmp(signature, "clearError()") == 0)
-					return wren_foreign_webdb_clearError;
-				if(strcmp(signature, "wrapped_query(_)") == 0)
-					return wren_foreign_webdb_query;
-			}
-		}
-	}
-
-	ap_log_error("mod_wren.c", __LINE__, 1, APLOG_NOTICE, -1, NULL,
-			"Failed to find foreign method '%s.%s'", class_name, signature);
+	WrenState *wren_state = wrenGetUserData(vm);
 
-	return NULL;
+	wrenSetSlotString(vm, 0, wren_state->request_rec->method);
 }
 
 /**
- * Maps foreign classes to their related allocate and finalize functions.
- *
- * Allocate runs whenever a new instance of the object is created, before the
- * constructor.
+ * Request.path
  *
- * Finalize doesn't run when the object leaves scope. It gets called whenever
- * the garbage collection gets to it.
+ * Getter for the path component of the requested URI.
  */
-static WrenForeignClassMethods wren_bind_foreign_class(WrenVM *vm,
-		const char *module, const char *class_name)
+static void wren_foreign_request_path(WrenVM *vm)
 {
-	WrenForeignClassMethods ret;
-	ret.allocate = NULL;
-	ret.finalize = NULL;
-
-	if(strcmp(module, "main") == 0) {
-		if(strcmp(class_name, "WebDB") == 0) {
-			ret.allocate = wren_foreign_dbd_allocate;
-			ret.finalize = wren_foreign_dbd_finalize;
-		}
-	}
+	WrenState *wren_state = wrenGetUserData(vm);
 
-	return ret;
+	wrenSetSlotString(vm, 0, wren_state->request_rec->uri);
 }
 
 /**
- * Load a separate module to use in the current scope.
- *
- * We try to keep the syntax as close to regular Wren imports as possible:
- *
- *   - 'import "something"' will return something.wren relative to the current
- *     directory, if it exists.
+ * Request.query
  *
- *   - 'import "/something"' will work from the web server root and return
- *     something.wren from there, if it exists.
+ * Getter for the raw query string, or null if there isn't one.
  */
-static char* wren_load_module(WrenVM *vm, const char *name)
+static void wren_foreign_request_query(WrenVM *vm)
 {
 	WrenState *wren_state = wrenGetUserData(vm);
-	request_rec *r = wren_state->request_rec;
+	const char *args = wren_state->request_rec->args;
 
-	char path[FILENAME_MAX];
-	size_t path_len = 0;
+	if(args != NULL)
+		wrenSetSlotString(vm, 0, args);
+	else
+		wrenSetSlotNull(vm, 0);
+}
 
-	if(name[0] == '/') {
-		const char *document_root = ap_context_document_root(r);
+/**
+ * Copies a whole table into a new Wren map in slot 0. Only used when a script
+ * asks to enumerate everything, since single lookups don't need the copy.
+ */
+static void wren_table_to_map(WrenState *wren_state, const apr_table_t *table)
+{
+	WrenVM *vm = wren_state->vm;
+	const apr_array_header_t *elts = apr_table_elts(table);
 
-		/* Start from the web server root. */
-		strcpy(path, document_root);
-		path_len = strlen(document_root);
+	wrenSetSlotNewMapWithCapacity(vm, 0, elts->nelts);
+	wren_headers_to_map(wren_state, elts);
+}
 
-		/* Add on the filename provided to us. */
-		strcpy(path + path_len, name);
-		path_len += strlen(name);
-	}
-	else {
-		/*
-		 * Get the current filepath and strip off the file name to get out
-		 * directory.
-		 */
-		const char *dirname_end = strrchr(r->canonical_filename, '/') + 1;
-		size_t dirname_len = dirname_end - r->canonical_filename;
+/**
+ * Request.headers
+ *
+ * Returns every request header as a Map of key/value strings.
+ */
+static void wren_foreign_request_headers(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
 
-		strncpy(path, r->canonical_filename, dirname_len);
-		path_len += dirname_len;
+	wren_state->personal = true;
+	wren_table_to_map(wren_state, wren_state->request_rec->headers_in);
+}
 
-		/* And add on our name. */
-		strcpy(path + path_len, name);
-		path_len += strlen(name);
-	}
+/**
+ * Request.environment
+ *
+ * Returns every environment variable as a Map of key/value strings.
+ */
+static void wren_foreign_request_environment(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
 
-	strcpy(path + path_len, ".wren");
-	path_len += 5;
-	path[path_len + strlen(name)] = '\0';
+	wren_state->personal = true;
+	wren_table_to_map(wren_state, wren_state->request_rec->subprocess_env);
+}
 
-	/* We've got a complete path, so try load the file and return the code. */
+/**
+ * Request.cookies
+ *
+ * Returns every cookie as a Map of key/value strings.
+ */
+static void wren_foreign_request_cookies(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
 
-	FILE *file = fopen(path, "r");
-	size_t file_len = 0;
+	wren_table_to_map(wren_state, wren_request_cookies(wren_state));
+}
 
-	if(file == NULL)
-		return NULL;
+/**
+ * Set a cookie.
+ *
+ * Slot 1: Cookie name (string)
+ * Slot 2: Cookie value (string)
+ * Slot 3: Expiration time in seconds (double)
+ * Slot 4: Cookie path (string)
+ */
+static void wren_fn_setCookie(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
 
-	fseek(file, 0, SEEK_END);
-	file_len = ftell(file) ?: 1;
-	fseek(file, 0, SEEK_SET);
+	const char *cookie;
+	const char *name  = wrenGetSlotString(vm, 1);
+	const char *value = wrenGetSlotString(vm, 2);
+	int expires       = wrenGetSlotDouble(vm, 3);
+	const char *path  = wrenGetSlotString(vm, 4);
 
-	if(file_len == 0) {
-		fclose(file);
-		return NULL;
+	if(expires > 0) {
+		cookie = apr_psprintf(r->pool, "%s=%s; Max-Age=%u;Path=%s;",
+				name, value, expires, path);
 	}
-
-	char *output_buf = malloc(file_len + 1);
-	size_t read_len = fread(output_buf, 1, file_len, file);
-
-	output_buf[file_len] = '\0';
-	fclose(file);
-
-	if(read_len != file_len) {
-		free(output_buf);
-		return NULL;
+	else {
+		cookie = apr_psprintf(r->pool, "%s=%s; Path=%s;",
+				name, value, path);
 	}
 
-	return output_buf;
+	apr_table_set(r->headers_out, "Set-Cookie", cookie);
 }
 
-static void module_init(apr_pool_t *pool, server_rec *s)
+/**
+ * Set the content type to be returned by the Wren handler on successful page
+ * delivery.
+ */
+static void wren_fn_setContentType(WrenVM *vm)
 {
-	ap_log_error("mod_wren.c", __LINE__, 1, APLOG_NOTICE, -1, NULL,
-			"Initialising mod_wren");
+	WrenState *wren_state = wrenGetUserData(vm);
 
-	WrenConfiguration config;
-	wrenInitConfiguration(&config);
-	config.writeFn = wren_write;
-	config.errorFn = wren_err;
-	config.bindForeignMethodFn = wren_bind_foreign_method;
-	config.bindForeignClassFn  = wren_bind_foreign_class;
-	config.loadModuleFn        = wren_load_module;
+	if(wrenGetSlotType(vm, 1) == WREN_TYPE_STRING)
+		wren_state->content_type = wrenGetSlotString(vm, 1);
+}
 
-	wren_states = calloc(NUM_WREN_STATES, sizeof(WrenState));
-	pthread_mutex_init(&wren_states_lock, 0);
+/**
+ * Set the content type to be returned by the Wren handler on successful page
+ * delivery.
+ *
+ * Slot 1/String: Header to write.
+ * Slot 2/String: Value to assign to header.
+ */
+static void wren_fn_setHeader(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
 
-	for(size_t i = 0; i < NUM_WREN_STATES; ++i) {
-		wren_states[i].vm = wrenNewVM(&config);
+	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING ||
+			wrenGetSlotType(vm, 2) != WREN_TYPE_STRING)
+		return;
 
-		wrenSetUserData(wren_states[i].vm, &wren_states[i]);
+	apr_table_set(r->headers_out,
+			wrenGetSlotString(vm, 1), wrenGetSlotString(vm, 2));
+}
 
-		/*
-		 * Declare foreign methods as the first thing the VM runs so that
-		 * they're available for all page loads.
-		 *
-		 * TODO: Wren has a bug with the foreign method API where methods where
-		 * for methods that return a list, the list comes out as a Num type
-		 * until something else has been run. To work around this we have
-		 * foreign methods returning lists act as a wrapper for the actual
-		 * functionality, plus a print before the return.
-		 */
-		wrenInterpret(wren_states[i].vm,
-				"class Web {\n"
-				"	foreign static getCookie(a)\n"
-				"	foreign static setCookie(a,b,c,d)\n"
-				"	foreign static setContentType(a)\n"
-				"	foreign static setHeader(a,b)\n"
-				"	foreign static setReturnCode(a)\n"
-				"	foreign static setStatusCode(a)\n"
-				"	foreign static wrapped_getEnv()\n"
-				"	foreign static wrapped_parseGet()\n"
-				"	foreign static wrapped_parsePost()\n"
-
-				"	static getEnv() {\n"
-				"		var ret = Web.wrapped_getEnv()\n"
-				"		System.write(\"\")\n"
-				"		return ret\n"
-				"	}\n"
-				"	static parseGet() {\n"
-				"		var ret = Web.wrapped_parseGet()\n"
-				"		System.write(\"\")\n"
-				"		return ret\n"
-				"	}\n"
-				"	static parsePost() {\n"
-				"		var ret = Web.wrapped_parsePost()\n"
-				"		System.write(\"\")\n"
-				"		return ret\n"
-				"	}\n"
-				"}\n"
-				"\n"
-
-				"foreign class WebDB {\n"
-				"	foreign construct open(a)\n"
-				"	foreign close()\n"
-				"	foreign isAlive\n"
-				"	foreign run(a)\n"
-				"	foreign escape(a)\n"
-				"	foreign error\n"
-				"	foreign clearError()\n"
-
-				"	foreign wrapped_query(a)\n"
-				"	query(q) {\n"
-				"		var ret = this.wrapped_query(q)\n"
-				"		System.write(\"\")\n"
-				"		return ret\n"
-				"	}\n"
-				"}\n"
-			);
-	}
-}
-
-/**
- * Returns the first available WrenState, or spins until one is available.
+#define WREN_HTTP_EARLY_HINTS 103
+
+/**
+ * Web.preload(url, as)
+ *
+ * Adds a Link header asking the browser to preload 'url' as the given kind
+ * of resource. It goes out with the final response, and with any Early Hints
+ * sent from here on.
  */
-static WrenState* wren_acquire_state(request_rec *r)
+static void wren_fn_preload(WrenVM *vm)
 {
-	WrenState *out = NULL;
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
+	const char *url, *as, *link;
 
-	pthread_mutex_lock(&wren_states_lock);
-	for(size_t i = 0; i < NUM_WREN_STATES; ++i) {
-		if(wren_states[i].lock == false) {
-			wren_states[i].lock = true;
-			out = &wren_states[i];
-			break;
-		}
-	}
-	pthread_mutex_unlock(&wren_states_lock);
+	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING ||
+			wrenGetSlotType(vm, 2) != WREN_TYPE_STRING)
+		return;
 
-	if(out != NULL) {
-		out->request_rec = r;
-		out->content_type = NULL;
-		out->status_code = HTTP_OK;
-		out->return_code = OK;
+	url = wrenGetSlotString(vm, 1);
+	as = wrenGetSlotString(vm, 2);
 
-		return out;
-	}
+	/* Either would let the page write a header of its own. */
+	if(strpbrk(url, "<>\r\n") != NULL || strpbrk(as, ";,\"\r\n") != NULL)
+		return;
+
+	/* Fonts are always fetched in CORS mode, and the preload must match. */
+	link = apr_psprintf(r->pool, "<%s>; rel=preload; as=%s%s", url, as,
+			strcmp(as, "font") == 0 ? "; crossorigin" : "");
+
+	if(wren_state->preloads == NULL)
+		wren_state->preloads = apr_array_make(r->pool, 4, sizeof(const char*));
 
-	apr_sleep(125000);
-	return wren_acquire_state(r);
+	APR_ARRAY_PUSH(wren_state->preloads, const char*) = link;
+	apr_table_addn(r->headers_out, "Link", link);
 }
 
 /**
- * Release a WrenState to be reused.
+ * Web.earlyHints()
+ *
+ * Sends a 103 Early Hints response with the Link headers added by
+ * Web.preload() since the last one, so the browser can start fetching them
+ * while the page is still running. Returns false if there was nothing to
+ * send, or it's too late to send it.
  */
-static void wren_release_state(WrenState *wren_state)
+static void wren_fn_earlyHints(WrenVM *vm)
 {
-	/*
-	 * Clear out all modules, so user-defined modules can be reimported
-	 * on page load (since they may have changed).
-	 */
-	wrenUnloadModules(wren_state->vm);
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
+	apr_array_header_t *preloads = wren_state->preloads;
+	apr_table_t *headers_out = r->headers_out;
+	const char *status_line = r->status_line;
+	int status = r->status;
+
+	/* HTTP/1.0 has no interim responses, and none can follow the body. */
+	if(preloads == NULL || wren_state->preloads_sent == preloads->nelts ||
+			r->proto_num < 1001 || r->sent_bodyct != 0)
+	{
+		wrenSetSlotBool(vm, 0, false);
+		return;
+	}
 
 	/*
-	 * Forces cleanup of all foreign classes, which means all our hanging
-	 * database connections will get closed.
+	 * ap_send_interim_response() sends, then clears, all of headers_out, so
+	 * it's given a table of just the new links.
 	 */
-	wrenCollectGarbage(wren_state->vm);
+	r->headers_out = apr_table_make(r->pool, preloads->nelts);
 
-	wren_state->request_rec = NULL;
-	wren_state->lock = false;
+	for(int i = wren_state->preloads_sent; i < preloads->nelts; ++i)
+		apr_table_addn(r->headers_out, "Link",
+				APR_ARRAY_IDX(preloads, i, const char*));
+
+	r->status = WREN_HTTP_EARLY_HINTS;
+	r->status_line = "103 Early Hints";
+	ap_send_interim_response(r, 1);
+
+	r->headers_out = headers_out;
+	r->status_line = status_line;
+	r->status = status;
+
+	wren_state->preloads_sent = preloads->nelts;
+	wrenSetSlotBool(vm, 0, true);
 }
 
 /**
- * Resizes the given wren_buf to be larger than the current capacity.
+ * Adds the file at name to the page's output as a file bucket, so it's sent
+ * with sendfile() where possible rather than copied through the VM. Absolute
+ * paths are used as they are, so downloads can be kept outside the web server
+ * root; others are relative to the page.
  *
- * Hopefully PARSE_BUFFER_GROWTH_RATE is sensible enough that the number of
- * times this happens is kept to a minimum.
+ * Returns false if the file can't be opened.
  */
-static void parse_grow_buffer(char **wren_buf, size_t *wren_index,
-		size_t *capacity)
+static bool wren_output_file(WrenState *wren_state, const char *name,
+		apr_finfo_t *finfo)
 {
-	size_t new_capacity = *capacity * PARSE_BUFFER_GROWTH_RATE + 1;
-	char *new_buf = calloc(new_capacity, 1);
+	request_rec *r = wren_state->request_rec;
+	const char *path = name;
+	apr_file_t *file;
 
-	strncpy(new_buf, *wren_buf, *wren_index);
+	if(name[0] != '/') {
+		const char *dirname_end = strrchr(r->canonical_filename, '/') + 1;
 
-	free(*wren_buf);
-	*wren_buf = new_buf;
-	*capacity = new_capacity;
+		path = apr_pstrcat(r->pool, apr_pstrmemdup(r->pool,
+				r->canonical_filename, dirname_end - r->canonical_filename),
+				name, NULL);
+	}
+
+	if(apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY |
+				APR_FOPEN_SENDFILE_ENABLED, APR_OS_DEFAULT, r->pool) !=
+			APR_SUCCESS)
+	{
+		return false;
+	}
+
+	if(apr_file_info_get(finfo, APR_FINFO_SIZE | APR_FINFO_MTIME |
+				APR_FINFO_TYPE, file) != APR_SUCCESS || finfo->filetype != APR_REG)
+	{
+		apr_file_close(file);
+		return false;
+	}
+
+	/*
+	 * Anything already written with ap_rputs() is held by the old_write
+	 * filter, which sends it ahead of this brigade.
+	 */
+	if(wren_state->output == NULL) {
+		wren_state->output = apr_brigade_create(r->pool,
+				r->connection->bucket_alloc);
+	}
+
+	apr_brigade_insert_file(wren_state->output, file, 0, finfo->size,
+			r->pool);
+	wren_state->files = true;
+
+	return true;
 }
 
 /**
- * Write the given write_str to the wren_buf, resizing if necessary and pushing
- * wren_index along.
+ * Web.sendFile(path, contentType)
+ *
+ * Sends a file as the page's response, without reading it into the VM. Range
+ * requests are answered by httpd's byterange filter, and conditional ones by
+ * ap_meets_conditions(), as for any other file. Returns false if the file
+ * can't be opened.
  */
-static void parse_write(char **wren_buf, size_t *wren_index, size_t *capacity,
-		const char *write_str)
+static void wren_fn_sendFile(WrenVM *vm)
 {
-	size_t len = strlen(write_str);
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
+	apr_finfo_t finfo;
 
-	while(*wren_index + len >= *capacity)
-		parse_grow_buffer(wren_buf, wren_index, capacity);
+	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING ||
+			wrenGetSlotType(vm, 2) != WREN_TYPE_STRING ||
+			wren_output_file(wren_state, wrenGetSlotString(vm, 1), &finfo) ==
+			false)
+	{
+		wrenSetSlotBool(vm, 0, false);
+		return;
+	}
 
-	strncpy(*wren_buf + *wren_index, write_str, len);
-	*wren_index += len;
+	wren_state->content_type = apr_pstrdup(r->pool, wrenGetSlotString(vm, 2));
+	ap_update_mtime(r, finfo.mtime);
+	ap_set_last_modified(r);
+
+	/*
+	 * Tagged as httpd tags static files by default, from their size and
+	 * mtime. ap_set_etag() would tag the page instead.
+	 */
+	apr_table_setn(r->headers_out, "ETag", apr_psprintf(r->pool,
+				"\"%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "\"",
+				(apr_uint64_t)finfo.size, (apr_uint64_t)finfo.mtime));
+
+	/* A client with the file already gets a 304, and no body. */
+	int conditions = ap_meets_conditions(r);
+
+	if(conditions != OK) {
+		apr_brigade_cleanup(wren_state->output);
+		wren_state->return_code = conditions;
+	}
+
+	wrenSetSlotBool(vm, 0, true);
 }
 
 /**
- * Copy write_len from buf to wren_buf, resizing wren_buf if necessary and
- * pushing wren_index and buf_index along.
+ * Web.spliceFile(path)
+ *
+ * Inserts a file's contents into the page at this point, without reading it
+ * into the VM. Returns false if the file can't be opened.
  */
-static void parse_write_from_buf(char **wren_buf, size_t *wren_index,
-		size_t *capacity, const char *buf, size_t *buf_index, size_t write_len)
+static void wren_fn_spliceFile(WrenVM *vm)
 {
-	while(*wren_index + write_len >= *capacity)
-		parse_grow_buffer(wren_buf, wren_index, capacity);
+	WrenState *wren_state = wrenGetUserData(vm);
+	apr_finfo_t finfo;
 
-	strncpy(*wren_buf + *wren_index, buf + *buf_index, write_len);
-	*buf_index += write_len;
-	*wren_index += write_len;
+	wrenSetSlotBool(vm, 0, wrenGetSlotType(vm, 1) == WREN_TYPE_STRING &&
+			wren_output_file(wren_state, wrenGetSlotString(vm, 1), &finfo));
 }
 
 /**
- * Write an HTML block inside the file_buf, starting from file_index,
- * to the output wren_buf, starting at wren_index.
+ * Web.defer(fn)
  *
- * file_index will get progressed by html_len, the amount of raw HTML
- * within the file. wren_index will get progressed a bit more, html_len plus
- * extra characters for function calls and escaping.
+ * Queues a function to run once the response has been sent. Web.defer()
+ * checks it's a function before it gets here.
  */
-static void parse_write_html(char **wren_buf, size_t *wren_index,
-		size_t *wren_capacity, const char *file_buf, size_t *file_index,
-		size_t html_len)
+static void wren_fn_defer(WrenVM *vm)
 {
-	if(html_len == 0 || (html_len == 1 && *(file_buf + *file_index) == '\n'))
+	WrenState *wren_state = wrenGetUserData(vm);
+
+	if(wren_state->deferred == NULL) {
+		wren_state->deferred = apr_array_make(wren_state->request_rec->pool, 4,
+				sizeof(WrenHandle*));
+	}
+
+	APR_ARRAY_PUSH(wren_state->deferred, WrenHandle*) = wrenGetSlotHandle(vm, 1);
+}
+
+/* Defined with the parser and the compile cache, below. */
+static int wren_parse_file(const char *filename, char **wren_code, bool raw);
+static WrenHandle* wren_compile(WrenState *wren_state, const char *module,
+		const char *source);
+
+/**
+ * Web.partial_(path)
+ *
+ * Returns the compiled body of the page at path, which is found the same way
+ * as an import, or null if it can't be loaded. Pages are translated and
+ * compiled the first time a request includes them, then reused for the rest
+ * of it, so their HTML goes out as ready-made strings.
+ *
+ * Paths can't climb out of the document root, or out of the page's own
+ * directory if the page is outside the document root.
+ */
+static void wren_fn_partial(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
+	WrenPartial *partial;
+	WrenHandle *compiled;
+	apr_finfo_t finfo;
+	const char *name, *root, *extension;
+	char *path, *wren_code;
+
+	if(wrenGetSlotType(vm, 1) != WREN_TYPE_STRING) {
+		wrenSetSlotNull(vm, 0);
 		return;
+	}
 
+	name = wrenGetSlotString(vm, 1);
+	root = ap_context_document_root(r);
 
-	/*
-	 * If the piece of code was one of our System.write() calls, append to it
-	 * to keep the line numbers in check.
-	 */
-	bool prev_was_write = *(*wren_buf + *wren_index - 1) == ')';
-	parse_write(wren_buf, wren_index, wren_capacity,
-			prev_was_write ? "+System.write(\"" : "System.write(\"");
+	if(name[0] == '/') {
+		++name;
+	}
+	else {
+		const char *dirname_end = strrchr(r->canonical_filename, '/') + 1;
+		size_t root_len = strlen(root);
+
+		while(root_len > 0 && root[root_len - 1] == '/')
+			--root_len;
+
+		/* Made relative to the document root, if the page is under it. */
+		if(strncmp(r->canonical_filename, root, root_len) == 0 &&
+				r->canonical_filename[root_len] == '/')
+		{
+			name = apr_pstrcat(r->pool, apr_pstrmemdup(r->pool,
+					r->canonical_filename + root_len + 1,
+					dirname_end - r->canonical_filename - root_len - 1),
+					name, NULL);
+		}
+		else {
+			root = apr_pstrmemdup(r->pool, r->canonical_filename,
+					dirname_end - r->canonical_filename);
+		}
+	}
+
+	if(apr_filepath_merge(&path, root, name, APR_FILEPATH_SECUREROOT,
+				r->pool) != APR_SUCCESS)
+	{
+		ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_WARNING, 0, r,
+				"Web.include() refused %s: outside %s",
+				wrenGetSlotString(vm, 1), root);
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	if(apr_stat(&finfo, path, APR_FINFO_MTIME, r->pool) != APR_SUCCESS) {
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	if(wren_state->partials == NULL) {
+		apr_pool_create(&wren_state->partials_pool, NULL);
+		wren_state->partials = apr_hash_make(wren_state->partials_pool);
+	}
+
+	partial = apr_hash_get(wren_state->partials, path, APR_HASH_KEY_STRING);
+
+	if(partial != NULL && partial->mtime == finfo.mtime) {
+		wrenSetSlotHandle(vm, 0, partial->compiled);
+		return;
+	}
+
+	extension = strrchr(path, '.');
+
+	if(wren_parse_file(path, &wren_code,
+				strcmp(extension ?: "", ".wren") == 0) != OK)
+	{
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
 
 	/*
-	 * Write the actual HTML segment to the buffer, escaping forbidden
-	 * characters as we go.
-	 *
-	 * This isn't the most elegantly written thing in the world.
+	 * The page's locals are declared on the line of its opening brace, so
+	 * errors still point at the right line.
 	 */
-	char *next_quote   = strchr(file_buf + *file_index, '"')  ?: (char*)INTPTR_MAX;
-	char *next_percent = strchr(file_buf + *file_index, '%')  ?: (char*)INTPTR_MAX;
-	char *next_slash   = strchr(file_buf + *file_index, '\\') ?: (char*)INTPTR_MAX;
+	compiled = wren_compile(wren_state, "main", apr_pstrcat(r->pool,
+				"{ var locals = Web.locals_", wren_code + 1, NULL));
+	free(wren_code);
+
+	if(compiled == NULL) {
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
+	if(partial == NULL) {
+		partial = apr_palloc(wren_state->partials_pool, sizeof(WrenPartial));
+		apr_hash_set(wren_state->partials,
+				apr_pstrdup(wren_state->partials_pool, path),
+				APR_HASH_KEY_STRING, partial);
+	}
+	else {
+		wrenReleaseHandle(vm, partial->compiled);
+	}
+
+	partial->compiled = compiled;
+	partial->mtime = finfo.mtime;
+
+	wrenSetSlotHandle(vm, 0, compiled);
+}
+
+/**
+ * Set the HTTP status code to be returned by the Wren handler on successful
+ * page delivery.
+ */
+static void wren_fn_setStatusCode(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+
+	if(wrenGetSlotType(vm, 1) == WREN_TYPE_NUM)
+		wren_state->status_code = wrenGetSlotDouble(vm, 1) + 0.5;
+}
+
+/**
+ * Set the HTTP return code to be invoke a server page response (e.g. a 404
+ * error page).
+ */
+static void wren_fn_setReturnCode(WrenVM *vm)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+
+	if(wrenGetSlotType(vm, 1) == WREN_TYPE_NUM)
+		wren_state->return_code = wrenGetSlotDouble(vm, 1) + 0.5;
+}
+
+/**
+ * Foreign methods bound in the "main" module, declared by the prelude in
+ * module_init().
+ */
+static const ModWrenMethod wren_main_methods[] = {
+	{ "Web", true,  "getCookie(_)",          wren_fn_getCookie },
+	{ "Web", true,  "setCookie(_,_,_,_)",    wren_fn_setCookie },
+	{ "Web", true,  "setContentType(_)",     wren_fn_setContentType },
+	{ "Web", true,  "setHeader(_,_)",        wren_fn_setHeader },
+	{ "Web", true,  "preload(_,_)",          wren_fn_preload },
+	{ "Web", true,  "earlyHints()",          wren_fn_earlyHints },
+	{ "Web", true,  "sendFile(_,_)",         wren_fn_sendFile },
+	{ "Web", true,  "spliceFile(_)",         wren_fn_spliceFile },
+	{ "Web", true,  "defer_(_)",             wren_fn_defer },
+	{ "Web", true,  "partial_(_)",           wren_fn_partial },
+	{ "Web", true,  "setReturnCode(_)",      wren_fn_setReturnCode },
+	{ "Web", true,  "setStatusCode(_)",      wren_fn_setStatusCode },
+	{ "Web", true,  "getEnv()",              wren_fn_getEnv },
+	{ "Web", true,  "parseGet()",            wren_fn_parseGet },
+	{ "Web", true,  "parsePost()",           wren_fn_parsePost },
+
+	{ "WebDB", false, "init open(_)",        wren_foreign_webdb_open },
+	{ "WebDB", false, "close()",             wren_foreign_webdb_close },
+	{ "WebDB", false, "isAlive",             wren_foreign_webdb_isAlive },
+	{ "WebDB", false, "run(_)",              wren_foreign_webdb_run },
+	{ "WebDB", false, "escape(_)",           wren_foreign_webdb_escape },
+	{ "WebDB", false, "error",               wren_foreign_webdb_error },
+	{ "WebDB", false, "clearError()",        wren_foreign_webdb_clearError },
+	{ "WebDB", false, "query_(_)",           wren_foreign_webdb_query },
+	{ "WebDB", false, "queryAsync_(_,_)",    wren_foreign_webdb_queryAsync },
+	{ "WebDB", true,  "queryAll_(_,_)",      wren_foreign_webdb_queryAll },
+	{ "WebDB", true,  "queryAllAsync_(_,_,_)", wren_foreign_webdb_queryAllAsync },
+
+	{ "Request", false, "header(_)",             wren_foreign_request_header },
+	{ "Request", false, "env(_)",                wren_foreign_request_env },
+	{ "Request", false, "cookie(_)",             wren_foreign_request_cookie },
+	{ "Request", false, "method",                wren_foreign_request_method },
+	{ "Request", false, "path",                  wren_foreign_request_path },
+	{ "Request", false, "query",                 wren_foreign_request_query },
+	{ "Request", false, "headers",               wren_foreign_request_headers },
+	{ "Request", false, "environment",           wren_foreign_request_environment },
+	{ "Request", false, "cookies",               wren_foreign_request_cookies },
+
+	{ NULL }
+};
+
+/**
+ * Allocate and finalize functions for foreign classes in the "main" module.
+ */
+static const ModWrenClass wren_main_classes[] = {
+	{ "WebDB",   wren_foreign_dbd_allocate, wren_foreign_dbd_finalize },
+	{ "Request", wren_foreign_request_allocate, NULL },
+
+	{ NULL }
+};
+
+/**
+ * Builds the key used to look up a foreign method or class in the binding
+ * tables. 'signature' is NULL for classes.
+ *
+ * Returns false if the key doesn't fit in 'key'.
+ */
+static bool wren_binding_key(char *key, size_t key_len, const char *module,
+		const char *class_name, bool is_static, const char *signature)
+{
+	int len;
+
+	if(signature == NULL)
+		len = snprintf(key, key_len, "%s %s", module, class_name);
+	else
+		len = snprintf(key, key_len, "%s %s %s%s", module, class_name,
+				is_static == true ? "static " : "", signature);
+
+	return len > 0 && (size_t)len < key_len;
+}
+
+/**
+ * Adds a module's foreign method and class tables to the binding tables.
+ */
+static void wren_register_bindings(apr_pool_t *pool, const char *module,
+		const ModWrenMethod *methods, const ModWrenClass *classes)
+{
+	char key[WREN_BINDING_KEY_MAX];
+
+	for(size_t i = 0; methods != NULL && methods[i].class_name != NULL; ++i) {
+		if(wren_binding_key(key, sizeof(key), module, methods[i].class_name,
+				methods[i].is_static, methods[i].signature) == false)
+			continue;
+
+		apr_hash_set(wren_foreign_methods, apr_pstrdup(pool, key),
+				APR_HASH_KEY_STRING, &methods[i]);
+	}
+
+	for(size_t i = 0; classes != NULL && classes[i].class_name != NULL; ++i) {
+		if(wren_binding_key(key, sizeof(key), module, classes[i].class_name,
+				false, NULL) == false)
+			continue;
+
+		apr_hash_set(wren_foreign_classes, apr_pstrdup(pool, key),
+				APR_HASH_KEY_STRING, &classes[i]);
+	}
+}
+
+/**
+ * Maps foreign method signatures to functions. We receive a signature of a
+ * function inside a class, inside a module, and look it up in the methods
+ * registered for "main" and any loaded extensions.
+ */
+static WrenForeignMethodFn wren_bind_foreign_method(WrenVM *vm,
+		const char *module, const char *class_name, bool is_static,
+		const char *signature)
+{
+	const ModWrenMethod *method = NULL;
+	char key[WREN_BINDING_KEY_MAX];
+
+	if(wren_binding_key(key, sizeof(key), module, class_name, is_static,
+			signature) == true)
+	{
+		method = apr_hash_get(wren_foreign_methods, key, APR_HASH_KEY_STRING);
+	}
+
+	if(method != NULL)
+		return method->fn;
+
+	ap_log_error("mod_wren.c", __LINE__, 1, APLOG_NOTICE, -1, NULL,
+			"Failed to find foreign method '%s.%s'", class_name, signature);
+
+	return NULL;
+}
+
+/**
+ * Maps foreign classes to their related allocate and finalize functions.
+ *
+ * Allocate runs whenever a new instance of the object is created, before the
+ * constructor.
+ *
+ * Finalize doesn't run when the object leaves scope. It gets called whenever
+ * the garbage collection gets to it.
+ */
+static WrenForeignClassMethods wren_bind_foreign_class(WrenVM *vm,
+		const char *module, const char *class_name)
+{
+	const ModWrenClass *foreign_class = NULL;
+	char key[WREN_BINDING_KEY_MAX];
+	WrenForeignClassMethods ret;
+	ret.allocate = NULL;
+	ret.finalize = NULL;
+
+	if(wren_binding_key(key, sizeof(key), module, class_name, false,
+			NULL) == true)
+	{
+		foreign_class = apr_hash_get(wren_foreign_classes, key,
+				APR_HASH_KEY_STRING);
+	}
+
+	if(foreign_class != NULL) {
+		ret.allocate = foreign_class->allocate;
+		ret.finalize = foreign_class->finalize;
+	}
+
+	return ret;
+}
+
+static void* wren_reallocate(void *memory, size_t new_size);
+
+/**
+ * Copies a module's source into memory from wren_reallocate(), which is how
+ * Wren frees it once the module is compiled.
+ */
+static char* wren_module_source(const char *source, size_t len)
+{
+	char *out = wren_reallocate(NULL, len + 1);
+
+	if(out != NULL) {
+		memcpy(out, source, len);
+		out[len] = '\0';
+	}
+
+	return out;
+}
+
+/**
+ * Load a separate module to use in the current scope.
+ *
+ * If the name matches a loaded extension, we return the extension's source.
+ * Otherwise, we try to keep the syntax as close to regular Wren imports as
+ * possible:
+ *
+ *   - 'import "something"' will return something.wren relative to the current
+ *     directory, if it exists.
+ *
+ *   - 'import "/something"' will work from the web server root and return
+ *     something.wren from there, if it exists.
+ */
+static char* wren_load_module(WrenVM *vm, const char *name)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+	request_rec *r = wren_state->request_rec;
+	const ModWrenExtension *extension;
+
+	char path[FILENAME_MAX];
+	size_t path_len = 0;
+
+	/* Extensions take priority over files on disk. */
+	extension = apr_hash_get(wren_extensions, name, APR_HASH_KEY_STRING);
+
+	if(extension != NULL) {
+		const char *source = extension->source ?: "";
+
+		return wren_module_source(source, strlen(source));
+	}
+
+	if(name[0] == '/') {
+		const char *document_root = ap_context_document_root(r);
+
+		/* Start from the web server root. */
+		strcpy(path, document_root);
+		path_len = strlen(document_root);
+
+		/* Add on the filename provided to us. */
+		strcpy(path + path_len, name);
+		path_len += strlen(name);
+	}
+	else {
+		/*
+		 * Get the current filepath and strip off the file name to get out
+		 * directory.
+		 */
+		const char *dirname_end = strrchr(r->canonical_filename, '/') + 1;
+		size_t dirname_len = dirname_end - r->canonical_filename;
+
+		strncpy(path, r->canonical_filename, dirname_len);
+		path_len += dirname_len;
+
+		/* And add on our name. */
+		strcpy(path + path_len, name);
+		path_len += strlen(name);
+	}
+
+	strcpy(path + path_len, ".wren");
+	path_len += 5;
+	path[path_len + strlen(name)] = '\0';
+
+	/* We've got a complete path, so try load the file and return the code. */
+
+	FILE *file = fopen(path, "r");
+	size_t file_len = 0;
+
+	if(file == NULL)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	file_len = ftell(file) ?: 1;
+	fseek(file, 0, SEEK_SET);
+
+	if(file_len == 0) {
+		fclose(file);
+		return NULL;
+	}
+
+	/* Wren frees the source itself, through wren_reallocate(). */
+	char *output_buf = wren_reallocate(NULL, file_len + 1);
+
+	if(output_buf == NULL) {
+		fclose(file);
+		return NULL;
+	}
+
+	size_t read_len = fread(output_buf, 1, file_len, file);
+
+	output_buf[file_len] = '\0';
+	fclose(file);
+
+	if(read_len != file_len) {
+		wren_reallocate(output_buf, 0);
+		return NULL;
+	}
+
+	return output_buf;
+}
+
+/**
+ * Returns the first free byte in an arena chunk.
+ */
+static char* wren_arena_chunk_data(WrenArenaChunk *chunk)
+{
+	return (char*)chunk + WREN_ALIGN(sizeof(WrenArenaChunk));
+}
+
+/**
+ * Allocates 'size' bytes plus a header from the arena, moving on to a new
+ * chunk if the current one is full.
+ *
+ * Returns NULL for allocations too large for the arena.
+ */
+static WrenAllocHeader* wren_arena_alloc(WrenArena *arena, size_t size)
+{
+	WrenArenaChunk *chunk = arena->current;
+	WrenAllocHeader *header;
+	size_t total = WREN_ALIGN(sizeof(WrenAllocHeader) + size);
+
+	if(total > WREN_ARENA_LARGE_ALLOC)
+		return NULL;
+
+	if(chunk == NULL || chunk->used + total > chunk->capacity) {
+		if(chunk != NULL) {
+			chunk->next = arena->full;
+			arena->full = chunk;
+		}
+
+		if(arena->spare != NULL) {
+			chunk = arena->spare;
+			arena->spare = chunk->next;
+			--arena->num_spare;
+		}
+		else {
+			chunk = malloc(WREN_ALIGN(sizeof(WrenArenaChunk)) +
+					WREN_ARENA_CHUNK_SIZE);
+
+			if(chunk == NULL)
+				return NULL;
+
+			chunk->capacity = WREN_ARENA_CHUNK_SIZE;
+		}
+
+		chunk->next = NULL;
+		chunk->used = 0;
+		chunk->live = 0;
+		chunk->live_bytes = 0;
+		arena->current = chunk;
+	}
+
+	header = (WrenAllocHeader*)(wren_arena_chunk_data(chunk) + chunk->used);
+	header->chunk = chunk;
+	header->size = size;
+
+	chunk->used += total;
+	chunk->live_bytes += total;
+	++chunk->live;
+
+	return header;
+}
+
+/**
+ * Tries to grow the most recent allocation in the current chunk without
+ * moving it. Growing lists and buffers usually hits this.
+ */
+static bool wren_arena_grow(WrenArena *arena, WrenAllocHeader *header,
+		size_t new_size)
+{
+	WrenArenaChunk *chunk = header->chunk;
+	size_t old_total = WREN_ALIGN(sizeof(WrenAllocHeader) + header->size);
+	size_t new_total = WREN_ALIGN(sizeof(WrenAllocHeader) + new_size);
+
+	if(chunk != arena->current || new_total > WREN_ARENA_LARGE_ALLOC)
+		return false;
+
+	if((char*)header + old_total != wren_arena_chunk_data(chunk) + chunk->used)
+		return false;
+
+	if(chunk->used - old_total + new_total > chunk->capacity)
+		return false;
+
+	chunk->used = chunk->used - old_total + new_total;
+	chunk->live_bytes = chunk->live_bytes - old_total + new_total;
+	header->size = new_size;
+
+	return true;
+}
+
+/**
+ * Called after the end-of-request collection. Every chunk with no live
+ * allocations left is reset in one go, however many objects it held.
+ */
+static void wren_arena_reset(WrenArena *arena)
+{
+	WrenArenaChunk **link = &arena->full;
+
+	if(arena->current != NULL && arena->current->live == 0)
+		arena->current->used = 0;
+
+	while(*link != NULL) {
+		WrenArenaChunk *chunk = *link;
+
+		if(chunk->live > 0) {
+			link = &chunk->next;
+			continue;
+		}
+
+		*link = chunk->next;
+
+		if(arena->num_spare < WREN_ARENA_SPARE_CHUNKS) {
+			chunk->next = arena->spare;
+			arena->spare = chunk;
+			++arena->num_spare;
+		}
+		else {
+			free(chunk);
+		}
+	}
+}
+
+/**
+ * Frees an allocation, whether it came from an arena or the heap.
+ */
+static void wren_free(WrenAllocHeader *header)
+{
+	if(wren_active_state != NULL)
+		wren_active_state->heap_size -= header->size;
+
+	if(header->chunk == NULL) {
+		free(header);
+	}
+	else {
+		header->chunk->live_bytes -=
+			WREN_ALIGN(sizeof(WrenAllocHeader) + header->size);
+		--header->chunk->live;
+	}
+}
+
+/**
+ * The bytes a state's VM holds beyond those it was created with. A copy of
+ * the template starts out with the template's classes, which pages shouldn't
+ * be charged for, so this is what the heap limits apply to.
+ */
+static size_t wren_heap_used(const WrenState *wren_state)
+{
+	return wren_state->heap_size > wren_state->heap_base ?
+		wren_state->heap_size - wren_state->heap_base : 0;
+}
+
+/**
+ * Counts 'size' new bytes against the active state's heap. If that takes a
+ * request past ModWrenHeapLimit, its fiber gets aborted at the next call or
+ * loop iteration.
+ */
+static void wren_heap_grow(size_t size)
+{
+	WrenState *wren_state = wren_active_state;
+
+	if(wren_state == NULL)
+		return;
+
+	wren_state->heap_size += size;
+
+	if(wren_heap_limit == 0 || wren_heap_used(wren_state) <= wren_heap_limit ||
+			wren_state->request_rec == NULL || wren_state->heap_exceeded == true)
+		return;
+
+	wren_state->heap_exceeded = true;
+	wrenInterrupt(wren_state->vm, WREN_HEAP_LIMIT_MESSAGE);
+}
+
+/**
+ * Refuses a new allocation that would take a running page past
+ * ModWrenHeapLimit by itself. Wren has no way to carry on without the memory,
+ * so the page is abandoned where it stands, back to wren_run(), and its VM is
+ * thrown away on release.
+ *
+ * VMs with suspended requests in them are left to the interrupt instead, as
+ * those requests still need them.
+ */
+static void wren_heap_refuse(size_t size)
+{
+	WrenState *wren_state = wren_active_state;
+
+	if(wren_heap_limit == 0 || wren_state == NULL ||
+			wren_state->escape == NULL || wren_state->suspended > 0 ||
+			wren_heap_used(wren_state) + size <= wren_heap_limit)
+		return;
+
+	wren_state->heap_exceeded = true;
+	wren_state->broken = true;
+	longjmp(*wren_state->escape, 1);
+}
+
+/**
+ * Wren's allocator.
+ *
+ * While a request is running, allocations are bumped from the arena of the
+ * state checked out on this thread. Outside of a request, and for large
+ * allocations, they come from the heap.
+ */
+static void* wren_reallocate(void *memory, size_t new_size)
+{
+	WrenAllocHeader *header = memory != NULL ? (WrenAllocHeader*)memory - 1 : NULL;
+	WrenAllocHeader *new_header = NULL;
+	WrenArena *arena = NULL;
+
+	if(wren_active_state != NULL && wren_active_state->request_rec != NULL)
+		arena = &wren_active_state->arena;
+
+	if(new_size == 0) {
+		if(header != NULL)
+			wren_free(header);
+
+		return NULL;
+	}
+
+	if(header != NULL && new_size <= header->size)
+		return memory;
+
+	if(header != NULL && header->chunk != NULL && arena != NULL) {
+		size_t old_size = header->size;
+
+		if(wren_arena_grow(arena, header, new_size) == true) {
+			wren_heap_grow(new_size - old_size);
+			return memory;
+		}
+	}
+
+	/* Heap allocations outside an arena can be resized in place. */
+	if(header != NULL && header->chunk == NULL && arena == NULL) {
+		size_t old_size = header->size;
+
+		if((new_header = realloc(header, sizeof(WrenAllocHeader) + new_size)) == NULL)
+			return NULL;
+
+		new_header->size = new_size;
+		wren_heap_grow(new_size - old_size);
+
+		return new_header + 1;
+	}
+
+	if(arena != NULL)
+		new_header = wren_arena_alloc(arena, new_size);
+
+	if(new_header == NULL) {
+		if(header == NULL)
+			wren_heap_refuse(new_size);
+
+		if((new_header = malloc(sizeof(WrenAllocHeader) + new_size)) == NULL)
+			return NULL;
+
+		new_header->chunk = NULL;
+		new_header->size = new_size;
+	}
+
+	wren_heap_grow(new_size);
+
+	if(header != NULL) {
+		memcpy(new_header + 1, memory, header->size);
+		wren_free(header);
+	}
+
+	return new_header + 1;
+}
+
+/**
+ * Frees every chunk in an arena. Only safe once the VM using it is gone.
+ */
+static void wren_arena_destroy(WrenArena *arena)
+{
+	WrenArenaChunk *lists[] = { arena->current, arena->full, arena->spare };
+
+	for(size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+		while(lists[i] != NULL) {
+			WrenArenaChunk *next = lists[i]->next;
+
+			free(lists[i]);
+			lists[i] = next;
+		}
+	}
+
+	memset(arena, 0x0, sizeof(WrenArena));
+}
+
+/**
+ * Returns the percentage of the memory in chunks pinned by survivors that
+ * isn't holding anything live, or 0 if too few chunks are pinned to matter.
+ */
+static int wren_arena_fragmentation(WrenArena *arena)
+{
+	size_t capacity = 0, live_bytes = 0, chunks = 0;
+
+	for(WrenArenaChunk *chunk = arena->full; chunk != NULL;
+			chunk = chunk->next)
+	{
+		capacity += chunk->capacity;
+		live_bytes += chunk->live_bytes;
+		++chunks;
+	}
+
+	if(arena->current != NULL && arena->current->live > 0) {
+		capacity += arena->current->capacity;
+		live_bytes += arena->current->live_bytes;
+		++chunks;
+	}
+
+	if(chunks < WREN_FRAGMENTATION_MIN_CHUNKS)
+		return 0;
+
+	return (int)(100 - live_bytes * 100 / capacity);
+}
+
+/**
+ * Samples the running fiber's call stack for the profiler, counting the time
+ * since the last sample against it. Called from the interrupt handler, so it
+ * only reads the VM, and once more as the request is released, for the time
+ * since the last sample.
+ */
+static void wren_profile_sample(WrenState *wren_state, apr_time_t now)
+{
+	WrenProfile *profile = wren_state->profile;
+	WrenStackFrame frames[WREN_PROFILE_DEPTH];
+	char stack[WREN_PROFILE_STACK_MAX];
+	apr_pool_t *pool = wren_state->request_rec->pool;
+	apr_int64_t *micros;
+	int depth;
+	size_t len;
+
+	depth = wrenGetCallStack(wren_state->vm, frames, WREN_PROFILE_DEPTH);
+	len = apr_cpystrn(stack, profile->root, sizeof(stack)) - stack;
+
+	/* Outermost first, the way flame graphs stack them. */
+	for(int i = depth - 1; i >= 0 && len < sizeof(stack) - 1; --i) {
+		len += snprintf(stack + len, sizeof(stack) - len, ";%s:%s:%d",
+				frames[i].module, frames[i].function,
+				wren_page_line(frames[i].line));
+	}
+
+	len = MIN(len, sizeof(stack) - 1);
+
+	if((micros = apr_hash_get(profile->stacks, stack, len)) == NULL) {
+		micros = apr_pcalloc(pool, sizeof(apr_int64_t));
+		apr_hash_set(profile->stacks, apr_pstrmemdup(pool, stack, len), len,
+				micros);
+	}
+
+	*micros += now - profile->last;
+	profile->last = now;
+	profile->due = false;
+}
+
+/**
+ * Starts profiling a request if ModWrenProfile is on for its directory, or
+ * it sent ModWrenProfileSecret. The page's URI is the root of its stacks.
+ */
+static WrenProfile* wren_profile_start(request_rec *r, WrenDirConfig *conf)
+{
+	const char *secret = apr_table_get(r->headers_in, WREN_PROFILE_HEADER);
+	WrenProfile *profile;
+	char *root;
+
+	if(wren_profile_log == NULL || (conf->profile != 1 &&
+				(wren_profile_secret == NULL || secret == NULL ||
+				 strcmp(secret, wren_profile_secret) != 0)))
+		return NULL;
+
+	/* Semicolons and spaces mean something else in collapsed stacks. */
+	root = apr_pstrdup(r->pool, r->uri ?: r->filename);
+	for(char *c = root; *c != '\0'; ++c) {
+		if(*c == ';' || *c == ' ')
+			*c = '_';
+	}
+
+	profile = apr_palloc(r->pool, sizeof(WrenProfile));
+	profile->stacks = apr_hash_make(r->pool);
+	profile->root = root;
+	profile->last = apr_time_now();
+	profile->due = false;
+
+	return profile;
+}
+
+/**
+ * Appends a profiled request's stacks to ModWrenProfileLog, one per line
+ * followed by its microseconds, ready for flamegraph.pl, inferno or
+ * speedscope. The same stack from different requests adds up.
+ */
+static void wren_profile_write(request_rec *r, WrenProfile *profile)
+{
+	apr_array_header_t *out = apr_array_make(r->pool,
+			apr_hash_count(profile->stacks) + 1, sizeof(const char*));
+	const char *lines;
+	apr_size_t written;
+
+	for(apr_hash_index_t *hi = apr_hash_first(r->pool, profile->stacks);
+			hi != NULL; hi = apr_hash_next(hi))
+	{
+		const char *stack;
+		apr_int64_t *micros;
+
+		apr_hash_this(hi, (const void**)&stack, NULL, (void**)&micros);
+		APR_ARRAY_PUSH(out, const char*) = apr_psprintf(r->pool,
+				"%s %" APR_INT64_T_FMT "\n", stack, *micros);
+	}
+
+	/* One write, so requests from different children don't interleave. */
+	lines = apr_array_pstrcat(r->pool, out, 0);
+	if(*lines != '\0')
+		apr_file_write_full(wren_profile_log, lines, strlen(lines), &written);
+}
+
+/**
+ * Starts keeping what the slow log needs of a request that started at
+ * 'start', if ModWrenSlowLog is set.
+ */
+static WrenSlow* wren_slow_start(WrenState *wren_state, apr_time_t start)
+{
+	WrenSlow *slow;
+
+	if(wren_slow_log == NULL)
+		return NULL;
+
+	slow = apr_pcalloc(wren_state->request_rec->pool, sizeof(WrenSlow));
+	slow->at = start + wren_slow_log_threshold;
+	slow->pool = wren_state->pool->name;
+	slow->heap_before = wren_state->heap_size;
+
+	return slow;
+}
+
+/**
+ * Called by Wren every WREN_INTERRUPT_PERIOD calls and loop iterations, or
+ * sooner when the profiler thread polls it; 'count' is how many there were.
+ * Once a request has run out of time or steps, its fiber gets aborted.
+ * Profiled requests are sampled here too, when the profiler thread says
+ * they're due, and the line a slow request is on is caught for the slow log.
+ */
+static const char* wren_check_budget(WrenVM *vm, int count)
+{
+	WrenState *wren_state = wrenGetUserData(vm);
+
+	wren_state->steps += count;
+
+	if(wren_state->profile != NULL && wren_state->profile->due == true)
+		wren_profile_sample(wren_state, apr_time_now());
+
+	wren_slow_check(wren_state);
+
+	if(wren_state->step_limit > 0 &&
+			wren_state->steps > wren_state->step_limit)
+	{
+		wren_state->budget_exceeded = true;
+		return WREN_STEP_LIMIT_MESSAGE;
+	}
+
+	if(wren_state->deadline > 0 && apr_time_now() > wren_state->deadline) {
+		wren_state->budget_exceeded = true;
+		return WREN_TIME_LIMIT_MESSAGE;
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates a VM and declares the foreign classes and methods every page can
+ * use.
+ */
+static WrenVM* wren_prelude_vm(void)
+{
+	WrenVM *vm = wrenNewVM(&wren_config);
+
+	/*
+	 * Declare foreign methods as the first thing the VM runs so that
+	 * they're available for all page loads.
+	 */
+	wrenInterpret(vm,
+			"class Web {\n"
+			"	foreign static getCookie(a)\n"
+			"	foreign static setCookie(a,b,c,d)\n"
+			"	foreign static setContentType(a)\n"
+			"	foreign static setHeader(a,b)\n"
+			"	foreign static preload(a,b)\n"
+			"	foreign static earlyHints()\n"
+			"	foreign static sendFile(a,b)\n"
+			"	foreign static spliceFile(a)\n"
+			"	foreign static setReturnCode(a)\n"
+			"	foreign static setStatusCode(a)\n"
+			"	foreign static getEnv()\n"
+			"	foreign static parseGet()\n"
+			"	foreign static parsePost()\n"
+			"	static request { __request || (__request = Request.current_()) }\n"
+
+			"	foreign static defer_(a)\n"
+			"	static defer(fn) {\n"
+			"		if (!(fn is Fn)) Fiber.abort(\"Web.defer() expects a function\")\n"
+			"		Web.defer_(fn)\n"
+			"	}\n"
+
+			"	foreign static partial_(a)\n"
+			"	static locals_ { __locals }\n"
+			"	static include(path) { include(path, {}) }\n"
+			"	static include(path, locals) {\n"
+			"		var body = Web.partial_(path)\n"
+			"		if (body == null) Fiber.abort(\"Web.include() couldn't load %(path)\")\n"
+			"		var outer = __locals\n"
+			"		__locals = locals\n"
+			"		body.call()\n"
+			"		__locals = outer\n"
+			"	}\n"
+
+			"	static parallel(fns) {\n"
+			"		if (!(fns is List) || fns.any {|fn| !(fn is Fn) }) {\n"
+			"			Fiber.abort(\"Web.parallel() expects a list of functions\")\n"
+			"		}\n"
+			"		return WebDB.parallel_(fns)\n"
+			"	}\n"
+
+			"	static saveStatics_ {\n"
+			"		var statics = [__locals, __request, WebDB.batch_]\n"
+			"		__locals = null\n"
+			"		__request = null\n"
+			"		WebDB.batch_ = null\n"
+			"		return statics\n"
+			"	}\n"
+			"	static restoreStatics_(statics) {\n"
+			"		__locals = statics[0]\n"
+			"		__request = statics[1]\n"
+			"		WebDB.batch_ = statics[2]\n"
+			"	}\n"
+			"}\n"
+			"\n"
+
+			"foreign class Request {\n"
+			"	construct current_() {}\n"
+			"	foreign header(a)\n"
+			"	foreign env(a)\n"
+			"	foreign cookie(a)\n"
+			"	foreign method\n"
+			"	foreign path\n"
+			"	foreign query\n"
+
+			"	foreign headers\n"
+			"	foreign environment\n"
+			"	foreign cookies\n"
+			"}\n"
+			"\n"
+
+			"foreign class WebDB {\n"
+			"	foreign construct open(a)\n"
+			"	foreign close()\n"
+			"	foreign isAlive\n"
+			"	foreign run(a)\n"
+			"	foreign escape(a)\n"
+			"	foreign error\n"
+			"	foreign clearError()\n"
+			"	foreign query_(a)\n"
+			"	foreign queryAsync_(a,b)\n"
+			"	query(q) {\n"
+			"		if (__batch != null && __batch.contains(Fiber.current)) {\n"
+			"			return Fiber.yield([this, q])\n"
+			"		}\n"
+			"		if (!queryAsync_(Fiber.current, q)) return query_(q)\n"
+			"		return Fiber.suspend()[0]\n"
+			"	}\n"
+			"	queryAll(queries) {\n"
+			"		return Web.parallel(queries.map {|q| Fn.new { query(q) } }.toList)\n"
+			"	}\n"
+
+			"	static batch_ { __batch }\n"
+			"	static batch_=(batch) { __batch = batch }\n"
+
+			"	foreign static queryAll_(a,b)\n"
+			"	foreign static queryAllAsync_(a,b,c)\n"
+			"	static all_(dbs, queries) {\n"
+			"		if (!queryAllAsync_(Fiber.current, dbs, queries)) {\n"
+			"			return queryAll_(dbs, queries)\n"
+			"		}\n"
+			"		return Fiber.suspend()\n"
+			"	}\n"
+			/*
+			 * Runs the batch on a fiber of its own, so __batch is put back
+			 * even if one of the functions aborts.
+			 */
+			"	static parallel_(fns) {\n"
+			"		var outer = __batch\n"
+			"		var fiber = Fiber.new { runBatch_(fns) }\n"
+			"		var results = fiber.try()\n"
+			"		__batch = outer\n"
+			"		if (fiber.error != null) Fiber.abort(fiber.error)\n"
+			"		return results\n"
+			"	}\n"
+			/*
+			 * Runs each function on a fiber of its own until they're all
+			 * waiting on a query, runs those queries side by side, and hands
+			 * them their rows, until every function has returned.
+			 */
+			"	static runBatch_(fns) {\n"
+			"		var fibers = fns.map {|fn| Fiber.new(fn) }.toList\n"
+			"		var results = List.filled(fibers.count, null)\n"
+			"		var waiting = (0...fibers.count).toList\n"
+			"		var rows = null\n"
+			"		__batch = fibers\n"
+			"		while (!waiting.isEmpty) {\n"
+			"			var dbs = []\n"
+			"			var queries = []\n"
+			"			var next = []\n"
+			"			for (i in 0...waiting.count) {\n"
+			"				var fiber = fibers[waiting[i]]\n"
+			"				var value = rows == null ? fiber.call() : fiber.call(rows[i])\n"
+			"				if (fiber.isDone) {\n"
+			"					results[waiting[i]] = value\n"
+			"				} else if (value is List && value.count == 2 && value[0] is WebDB) {\n"
+			"					next.add(waiting[i])\n"
+			"					dbs.add(value[0])\n"
+			"					queries.add(value[1])\n"
+			"				} else {\n"
+			"					Fiber.abort(\"Web.parallel() functions can only wait on queries\")\n"
+			"				}\n"
+			"			}\n"
+			"			waiting = next\n"
+			"			if (!waiting.isEmpty) rows = all_(dbs, queries)\n"
+			"		}\n"
+			"		return results\n"
+			"	}\n"
+			"}\n"
+		);
+
+	return vm;
+}
+
+/**
+ * Gives a state a VM of its own. Copying the template VM is much cheaper
+ * than compiling and running the prelude again, so that's only done when
+ * there's no template to copy, or copying it fails.
+ */
+static void wren_new_vm(WrenState *wren_state)
+{
+	WrenState *prev_state = wren_active_state;
+	WrenVM *vm = NULL;
+
+	/* Everything allocated here is accounted to this state's heap. */
+	wren_active_state = wren_state;
+
+	/* Other threads may be copying the template too, so it's left alone. */
+	if(wren_template_vm != NULL &&
+			(vm = wrenCloneVM(wren_template_vm)) == NULL)
+	{
+		ap_log_error("mod_wren.c", __LINE__, 1, APLOG_WARNING, -1, NULL,
+				"Couldn't copy the template VM; creating one from scratch");
+	}
+
+	if(vm == NULL)
+		vm = wren_prelude_vm();
+
+	wren_state->vm = vm;
+	wrenSetUserData(vm, wren_state);
+	wrenSetInterruptHandler(vm, wren_check_budget, WREN_INTERRUPT_PERIOD);
+
+	/* What the copy or the prelude took isn't the pages' to pay for. */
+	wren_state->heap_base = wren_state->heap_size;
+
+	wren_active_state = prev_state;
+}
+
+/**
+ * Releases the pages compiled by Web.include(). Their functions belong to the
+ * "main" module, so they can't outlive it.
+ */
+static void wren_clear_partials(WrenState *wren_state)
+{
+	if(wren_state->partials == NULL)
+		return;
+
+	for(apr_hash_index_t *hi = apr_hash_first(NULL, wren_state->partials);
+			hi != NULL; hi = apr_hash_next(hi))
+	{
+		WrenPartial *partial = apr_hash_this_val(hi);
+		wrenReleaseHandle(wren_state->vm, partial->compiled);
+	}
+
+	apr_pool_destroy(wren_state->partials_pool);
+	wren_state->partials_pool = NULL;
+	wren_state->partials = NULL;
+}
+
+/**
+ * Throws away a state's VM and everything it allocated.
+ */
+static void wren_destroy_vm(WrenState *wren_state)
+{
+	WrenState *prev_state = wren_active_state;
+
+	wren_active_state = wren_state;
+
+	wren_clear_partials(wren_state);
+	wrenFreeVM(wren_state->vm);
+	wren_active_state = prev_state;
+
+	wren_arena_destroy(&wren_state->arena);
+	wren_state->vm = NULL;
+	wren_state->broken = false;
+	wren_state->recreate_pending = false;
+	wren_state->heap_size = 0;
+	wren_state->heap_base = 0;
+	wren_state->requests = 0;
+}
+
+/**
+ * Replaces a state's VM with a fresh one.
+ */
+static void wren_recreate_vm(WrenState *wren_state)
+{
+	wren_destroy_vm(wren_state);
+	wren_new_vm(wren_state);
+	WREN_METRIC_ADD(vms_recreated, 1);
+}
+
+/**
+ * Hands a state that has just been unlocked on: to a suspended request waiting
+ * to resume on it if there is one, or else to the next request queued for its
+ * pool. Called with wren_states_lock held.
+ */
+static void wren_state_unlocked(WrenState *wren_state)
+{
+	if(wren_state->resuming > 0)
+		pthread_cond_broadcast(&wren_state->pool->resumable);
+	else
+		pthread_cond_signal(&wren_state->pool->available);
+}
+
+/**
+ * Destroys a pool's VMs that have gone unused for longer than
+ * ModWrenPoolIdleTimeout, keeping at least ModWrenPoolMin of them.
+ */
+static void wren_trim_pool(WrenPool *pool)
+{
+	apr_time_t now = apr_time_now();
+
+	for(size_t i = 0; i < pool->size; ++i) {
+		WrenState *wren_state = &pool->states[i];
+		bool trim;
+
+		pthread_mutex_lock(&wren_states_lock);
+		trim = wren_state->vm != NULL && wren_state->lock == false &&
+			wren_state->suspended == 0 &&
+			pool->num_vms > (size_t)wren_pool_min &&
+			now - wren_state->last_used > wren_pool_idle_timeout;
+
+		/* Held while it's destroyed, so no request picks it up. */
+		if(trim == true) {
+			wren_state->lock = true;
+			--pool->num_vms;
+		}
+		pthread_mutex_unlock(&wren_states_lock);
+
+		if(trim == false)
+			continue;
+
+		wren_destroy_vm(wren_state);
+
+		wren_metric_vms(pool, -1);
+		WREN_METRIC_ADD(vms_trimmed, 1);
+		WREN_METRIC_ADD(heap_bytes,
+				-(apr_int64_t)wren_state->heap_reported);
+		wren_state->heap_reported = 0;
+
+		pthread_mutex_lock(&wren_states_lock);
+		wren_state->lock = false;
+		wren_state_unlocked(wren_state);
+		pthread_mutex_unlock(&wren_states_lock);
+	}
+}
+
+/**
+ * Runs for the life of a child, trimming the pool every half idle timeout.
+ */
+static void* wren_trim_main(void *data)
+{
+	apr_time_t period = MAX(wren_pool_idle_timeout / 2, apr_time_from_sec(1));
+
+	pthread_mutex_lock(&wren_states_lock);
+
+	while(wren_trim_stop == false) {
+		apr_time_t wake = apr_time_now() + period;
+		struct timespec deadline = {
+			.tv_sec = apr_time_sec(wake),
+			.tv_nsec = apr_time_usec(wake) * 1000
+		};
+
+		pthread_cond_timedwait(&wren_trim_cond, &wren_states_lock, &deadline);
+
+		if(wren_trim_stop == true)
+			break;
+
+		pthread_mutex_unlock(&wren_states_lock);
+		for(int i = 0; i < wren_num_pools; ++i)
+			wren_trim_pool(&wren_pools[i]);
+		pthread_mutex_lock(&wren_states_lock);
+	}
+
+	pthread_mutex_unlock(&wren_states_lock);
+
+	return NULL;
+}
+
+/**
+ * Runs for the life of a child that can profile, polling the VMs of profiled
+ * requests every WREN_PROFILE_INTERVAL so they're sampled at their next call
+ * or loop iteration, however long their calls take to add up to
+ * WREN_INTERRUPT_PERIOD. Sleeps while nothing is being profiled.
+ */
+static void* wren_profile_main(void *data)
+{
+	pthread_mutex_lock(&wren_states_lock);
+
+	while(wren_profile_stop == false) {
+		if(wren_profiled == 0) {
+			pthread_cond_wait(&wren_profile_cond, &wren_states_lock);
+			continue;
+		}
+
+		apr_time_t wake = apr_time_now() + WREN_PROFILE_INTERVAL;
+		struct timespec deadline = {
+			.tv_sec = apr_time_sec(wake),
+			.tv_nsec = apr_time_usec(wake) * 1000
+		};
+
+		pthread_cond_timedwait(&wren_profile_cond, &wren_states_lock,
+				&deadline);
+
+		/*
+		 * A request's profile is only cleared under the lock, before its VM
+		 * can be recycled, so a VM with one set is safe to poll here.
+		 */
+		for(int i = 0; i < wren_num_pools && wren_profile_stop == false; ++i) {
+			WrenPool *pool = &wren_pools[i];
+
+			for(size_t j = 0; j < pool->size; ++j) {
+				WrenState *wren_state = &pool->states[j];
+
+				if(wren_state->lock == true && wren_state->profile != NULL) {
+					wren_state->profile->due = true;
+					wrenPollInterruptHandler(wren_state->vm);
+				}
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&wren_states_lock);
+
+	return NULL;
+}
+
+/**
+ * Takes this child's VMs back out of the shared gauges as it exits.
+ */
+static apr_status_t wren_child_exit(void *data)
+{
+	if(wren_trim_running == true) {
+		pthread_mutex_lock(&wren_states_lock);
+		wren_trim_stop = true;
+		pthread_cond_signal(&wren_trim_cond);
+		pthread_mutex_unlock(&wren_states_lock);
+
+		pthread_join(wren_trim_thread, NULL);
+		wren_trim_running = false;
+	}
+
+	if(wren_profile_running == true) {
+		pthread_mutex_lock(&wren_states_lock);
+		wren_profile_stop = true;
+		pthread_cond_signal(&wren_profile_cond);
+		pthread_mutex_unlock(&wren_states_lock);
+
+		pthread_join(wren_profile_thread, NULL);
+		wren_profile_running = false;
+	}
+
+	for(int i = 0; i < wren_num_pools; ++i) {
+		WrenPool *pool = &wren_pools[i];
+
+		wren_metric_vms(pool, -(apr_int64_t)pool->num_vms);
+
+		for(size_t j = 0; j < pool->size; ++j)
+			WREN_METRIC_ADD(heap_bytes,
+					-(apr_int64_t)pool->states[j].heap_reported);
+	}
+
+	return APR_SUCCESS;
+}
+
+static void module_init(apr_pool_t *pool, server_rec *s)
+{
+	ap_log_error("mod_wren.c", __LINE__, 1, APLOG_NOTICE, -1, NULL,
+			"Initialising mod_wren");
+
+	wrenInitConfiguration(&wren_config);
+	wren_config.reallocateFn = wren_reallocate;
+	wren_config.writeFn = wren_write;
+	wren_config.errorFn = wren_err;
+	wren_config.bindForeignMethodFn = wren_bind_foreign_method;
+	wren_config.bindForeignClassFn  = wren_bind_foreign_class;
+	wren_config.loadModuleFn        = wren_load_module;
+
+	if(wren_initial_heap_size > 0)
+		wren_config.initialHeapSize = wren_initial_heap_size;
+	if(wren_min_heap_size > 0)
+		wren_config.minHeapSize = wren_min_heap_size;
+	if(wren_heap_growth_percent > 0)
+		wren_config.heapGrowthPercent = wren_heap_growth_percent;
+
+	/* Gather up the bindings for "main" and every extension. */
+	wren_foreign_methods = apr_hash_make(pool);
+	wren_foreign_classes = apr_hash_make(pool);
+
+	wren_register_bindings(pool, "main", wren_main_methods, wren_main_classes);
+
+	for(apr_hash_index_t *i = apr_hash_first(pool, wren_extensions); i != NULL;
+			i = apr_hash_next(i))
+	{
+		const char *name;
+		const ModWrenExtension *extension;
+
+		apr_hash_this(i, (const void**)&name, NULL, (void**)&extension);
+		wren_register_bindings(pool, name, extension->methods,
+				extension->classes);
+	}
+
+	/* Collected now so that the prelude's garbage isn't copied into every VM. */
+	wren_template_vm = wren_prelude_vm();
+	wrenCollectGarbage(wren_template_vm);
+
+	/*
+	 * What stops a VM being copied is in the template itself, so one trial
+	 * copy tells whether it's any use, before threads start copying it.
+	 */
+	WrenVM *trial = wrenCloneVM(wren_template_vm);
+
+	if(trial == NULL) {
+		ap_log_error("mod_wren.c", __LINE__, 1, APLOG_WARNING, -1, NULL,
+				"Couldn't copy the template VM; creating VMs from scratch");
+
+		wrenFreeVM(wren_template_vm);
+		wren_template_vm = NULL;
+	}
+	else {
+		wrenFreeVM(trial);
+	}
+
+	apr_pool_create(&wren_output_cache_pool, pool);
+	wren_output_cache = apr_hash_make(wren_output_cache_pool);
+	pthread_mutex_init(&wren_output_cache_lock, 0);
+
+	wren_num_pools = wren_pool_defs->nelts;
+	wren_pools = calloc(wren_num_pools, sizeof(WrenPool));
+	pthread_mutex_init(&wren_states_lock, 0);
+
+	for(int i = 0; i < wren_num_pools; ++i) {
+		WrenPoolDef *def = &APR_ARRAY_IDX(wren_pool_defs, i, WrenPoolDef);
+		WrenPool *wren_pool = &wren_pools[i];
+
+		wren_pool->name = def->name;
+		wren_pool->index = i;
+		wren_pool->size = def->size;
+
+		/* By default, one VM for each thread that could be serving a page. */
+		if(i == 0 && wren_pool_max > 0) {
+			wren_pool->size = wren_pool_max;
+		}
+		else if(i == 0) {
+			int threads = 1;
+
+			ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+			wren_pool->size = MAX(threads, 1);
+		}
+
+		wren_pool->states = calloc(wren_pool->size, sizeof(WrenState));
+		pthread_cond_init(&wren_pool->available, NULL);
+		pthread_cond_init(&wren_pool->resumable, NULL);
+		wren_pool->num_vms = MIN((size_t)wren_pool_min, wren_pool->size);
+
+		for(size_t j = 0; j < wren_pool->size; ++j)
+			wren_pool->states[j].pool = wren_pool;
+
+		for(size_t j = 0; j < wren_pool->num_vms; ++j) {
+			wren_new_vm(&wren_pool->states[j]);
+			wren_pool->states[j].last_used = apr_time_now();
+		}
+
+		wren_metric_vms(wren_pool, wren_pool->num_vms);
+	}
+
+	if(wren_pool_idle_timeout > 0) {
+		pthread_cond_init(&wren_trim_cond, NULL);
+		wren_trim_stop = false;
+		wren_trim_running = pthread_create(&wren_trim_thread, NULL,
+				wren_trim_main, NULL) == 0;
+	}
+
+	if(wren_profile_log != NULL) {
+		pthread_cond_init(&wren_profile_cond, NULL);
+		wren_profile_stop = false;
+		wren_profiled = 0;
+		wren_profile_running = pthread_create(&wren_profile_thread, NULL,
+				wren_profile_main, NULL) == 0;
+	}
+	apr_pool_cleanup_register(pool, NULL, wren_child_exit,
+			apr_pool_cleanup_null);
+}
+
+/**
+ * Locks and returns a pool's most recently used free state, or a state to
+ * create a VM in if none is free, or NULL if they're all taken. Called with
+ * wren_states_lock held.
+ */
+static WrenState* wren_take_state(WrenPool *pool, bool *create)
+{
+	WrenState *out = NULL;
+
+	/*
+	 * Take the most recently used VM: it's the likeliest to be warm, and it
+	 * leaves the others to go idle and be trimmed. Those with a suspended
+	 * request waiting to resume are left to it.
+	 */
+	for(size_t i = 0; i < pool->size; ++i) {
+		WrenState *wren_state = &pool->states[i];
+
+		if(wren_state->lock == true || wren_state->vm == NULL ||
+				wren_state->resuming > 0)
+			continue;
+
+		if(out == NULL || wren_state->last_used > out->last_used)
+			out = wren_state;
+	}
+
+	/* Failing that, grow the pool if it isn't full. */
+	for(size_t i = 0; out == NULL && i < pool->size; ++i) {
+		if(pool->states[i].lock == false && pool->states[i].vm == NULL) {
+			out = &pool->states[i];
+			*create = true;
+			++pool->num_vms;
+		}
+	}
+
+	if(out != NULL)
+		out->lock = true;
+
+	return out;
+}
+
+/**
+ * Returns the first available WrenState in the request's pool, waiting for
+ * one to come free if they're all busy. Returns NULL if the request is turned
+ * away instead, because too many are waiting already or it waited longer than
+ * ModWrenQueueTimeout.
+ */
+static WrenState* wren_acquire_state(request_rec *r)
+{
+	WrenDirConfig *conf = ap_get_module_config(r->per_dir_config,
+			&wren_module);
+	WrenPool *pool = &wren_pools[conf->pool > 0 ? conf->pool : 0];
+	apr_time_t give_up = apr_time_now() + wren_queue_timeout;
+	struct timespec deadline = {
+		.tv_sec = apr_time_sec(give_up),
+		.tv_nsec = apr_time_usec(give_up) * 1000
+	};
+	WrenState *out = NULL;
+	bool create = false;
+
+	pthread_mutex_lock(&wren_states_lock);
+
+	while((out = wren_take_state(pool, &create)) == NULL) {
+		int status = 0;
+
+		if(wren_queue_max >= 0 && pool->waiting >= wren_queue_max)
+			break;
+
+		++pool->waiting;
+		WREN_METRIC_ADD(pools[pool->index].waiting, 1);
+
+		if(wren_queue_timeout > 0) {
+			status = pthread_cond_timedwait(&pool->available,
+					&wren_states_lock, &deadline);
+		}
+		else {
+			pthread_cond_wait(&pool->available, &wren_states_lock);
+		}
+
+		--pool->waiting;
+		WREN_METRIC_ADD(pools[pool->index].waiting, -1);
+
+		/* One last look, in case a VM came free as the wait ran out. */
+		if(status == ETIMEDOUT) {
+			out = wren_take_state(pool, &create);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&wren_states_lock);
+
+	if(out == NULL) {
+		WREN_METRIC_ADD(rejected, 1);
+		WREN_METRIC_ADD(pools[pool->index].rejected, 1);
+		return NULL;
+	}
+
+	if(create == true) {
+		wren_new_vm(out);
+		wren_metric_vms(pool, 1);
+	}
+
+	out->request_rec = r;
+	out->content_type = NULL;
+	out->status_code = HTTP_OK;
+	out->return_code = OK;
+	out->cookies = NULL;
+
+	out->steps = 0;
+	out->step_limit = conf->step_limit;
+	out->deadline = conf->time_limit > 0 ?
+		apr_time_now() + conf->time_limit : 0;
+
+	/* The slow log needs spans for whichever request turns out slow. */
+	out->spans = conf->timing == 1 || wren_slow_log != NULL ?
+		apr_array_make(r->pool, 8, sizeof(WrenSpan)) : NULL;
+	out->profile = wren_profile_start(r, conf);
+	out->slow = NULL;
+
+	if(out->profile != NULL) {
+		pthread_mutex_lock(&wren_states_lock);
+		if(wren_profiled++ == 0)
+			pthread_cond_signal(&wren_profile_cond);
+		pthread_mutex_unlock(&wren_states_lock);
+	}
+	out->output = NULL;
+	out->files = false;
+	out->personal = false;
+	out->preloads = NULL;
+	out->preloads_sent = 0;
+	out->deferred = NULL;
+
+	/* From here on, the VM allocates from the state's arena. */
+	wren_active_state = out;
+
+	wren_metric_busy(pool, 1);
+	WREN_METRIC_ADD(pools[pool->index].requests, 1);
+
+	return out;
+}
+
+/**
+ * Takes the static fields of Web and WebDB, which belong to the running
+ * request, and leaves them empty for the next. Returns them in a handle for
+ * wren_restore_statics(), or NULL if the VM couldn't be called, in which case
+ * they're left for the next request to see, and that's logged.
+ */
+static WrenHandle* wren_save_statics(WrenState *wren_state)
+{
+	WrenVM *vm = wren_state->vm;
+	WrenHandle *call = wrenMakeCallHandle(vm, "saveStatics_");
+	WrenHandle *statics = NULL;
+
+	wrenEnsureSlots(vm, 1);
+	wrenGetVariable(vm, "main", "Web", 0);
+
+	if(wrenCall(vm, call) == WREN_RESULT_SUCCESS)
+		statics = wrenGetSlotHandle(vm, 0);
+
+	wrenReleaseHandle(vm, call);
+
+	if(statics == NULL) {
+		ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_ERR, 0,
+				wren_state->request_rec, "Couldn't clear Web's statics for "
+				"%s out of its VM", wren_state->request_rec->uri);
+		WREN_METRIC_ADD(errors, 1);
+	}
+
+	return statics;
+}
+
+/**
+ * Puts back the static fields taken by wren_save_statics(), and releases
+ * their handle.
+ */
+static void wren_restore_statics(WrenState *wren_state, WrenHandle *statics)
+{
+	WrenVM *vm = wren_state->vm;
+	WrenHandle *call;
+
+	if(statics == NULL)
+		return;
+
+	call = wrenMakeCallHandle(vm, "restoreStatics_(_)");
+
+	wrenEnsureSlots(vm, 2);
+	wrenGetVariable(vm, "main", "Web", 0);
+	wrenSetSlotHandle(vm, 1, statics);
+	wrenCall(vm, call);
+
+	wrenReleaseHandle(vm, call);
+	wrenReleaseHandle(vm, statics);
+}
+
+/**
+ * Release a WrenState to be reused.
+ */
+static void wren_release_state(WrenState *wren_state)
+{
+	if(wren_state->profile != NULL) {
+		WrenProfile *profile = wren_state->profile;
+
+		/* Whatever ran since the last sample is counted too. */
+		wren_profile_sample(wren_state, apr_time_now());
+
+		pthread_mutex_lock(&wren_states_lock);
+		wren_state->profile = NULL;
+		--wren_profiled;
+		pthread_mutex_unlock(&wren_states_lock);
+
+		wren_profile_write(wren_state->request_rec, profile);
+	}
+
+	if(wren_state->slow != NULL) {
+		wren_state->slow->heap_after = wren_state->heap_size;
+		wren_state->slow = NULL;
+	}
+
+	/* Deferred work that never ran still holds onto its closures. */
+	if(wren_state->deferred != NULL) {
+		for(int i = 0; i < wren_state->deferred->nelts; ++i)
+			wrenReleaseHandle(wren_state->vm,
+					APR_ARRAY_IDX(wren_state->deferred, i, WrenHandle*));
+
+		wren_state->deferred = NULL;
+	}
+
+	/* As does a fiber that was about to wait on a query when it failed. */
+	if(wren_state->pending_fiber != NULL) {
+		wrenReleaseHandle(wren_state->vm, wren_state->pending_fiber);
+		wren_state->pending_fiber = NULL;
+		wren_state->pending = NULL;
+	}
+
+	/*
+	 * A broken VM may have been compiling, or halfway through changing an
+	 * object, so it's only fit to be freed below.
+	 */
+	if(wren_state->broken == false) {
+		if(wren_state->suspended > 0) {
+			/*
+			 * Suspended requests are still running in "main", so it stays
+			 * until the last of them is released. Only this request's
+			 * statics are cleared out of it, with any interrupt that
+			 * aborted it cleared first, and its budget lifted, so the call
+			 * can run.
+			 */
+			WrenHandle *statics;
+
+			wrenClearInterrupt(wren_state->vm);
+			wren_state->step_limit = 0;
+			wren_state->deadline = 0;
+			statics = wren_save_statics(wren_state);
+
+			if(statics != NULL)
+				wrenReleaseHandle(wren_state->vm, statics);
+		}
+		else {
+			/*
+			 * Clear out all modules, so user-defined modules can be
+			 * reimported on page load (since they may have changed).
+			 * Included pages go with "main".
+			 */
+			wren_clear_partials(wren_state);
+			wrenUnloadModules(wren_state->vm);
+		}
+
+		/*
+		 * Forces cleanup of all foreign classes, which means all our hanging
+		 * database connections will get closed.
+		 */
+		apr_time_t gc_start = apr_time_now();
+		wrenCollectGarbage(wren_state->vm);
+		wren_record_phase(wren_state->spans, WREN_PHASE_GC, gc_start, NULL,
+				false);
+	}
+
+	/* Whatever died with the request frees up its arena chunks. */
+	wren_arena_reset(&wren_state->arena);
+	wren_active_state = NULL;
+
+	wrenClearInterrupt(wren_state->vm);
+	wren_state->request_rec = NULL;
+	wren_state->spans = NULL;
+	wren_state->output = NULL;
+	wren_state->files = false;
+	wren_state->personal = false;
+	wren_state->preloads = NULL;
+	++wren_state->requests;
+
+	/*
+	 * A VM that was aborted, or is still holding onto too much after the
+	 * collection, would keep that memory in the pool for good. Survivors
+	 * scattered across arena chunks pin them the same way. One with
+	 * suspended requests in it has to wait until they're done, so the last
+	 * of them to be released recreates it.
+	 */
+	if(wren_state->heap_exceeded == true ||
+			wren_state->budget_exceeded == true ||
+			(wren_heap_watermark > 0 &&
+			 wren_heap_used(wren_state) > wren_heap_watermark) ||
+			(wren_recycle_requests > 0 &&
+			 wren_state->requests >= wren_recycle_requests) ||
+			(wren_recycle_fragmentation > 0 &&
+			 wren_arena_fragmentation(&wren_state->arena) >=
+			 wren_recycle_fragmentation))
+	{
+		wren_state->recreate_pending = true;
+	}
+
+	if(wren_state->suspended == 0 && wren_state->recreate_pending == true)
+		wren_recreate_vm(wren_state);
+
+	wren_state->heap_exceeded = false;
+	wren_state->budget_exceeded = false;
+
+	WREN_METRIC_ADD(heap_bytes,
+			(apr_int64_t)wren_state->heap_size -
+			(apr_int64_t)wren_state->heap_reported);
+	wren_state->heap_reported = wren_state->heap_size;
+	wren_metric_busy(wren_state->pool, -1);
+
+	pthread_mutex_lock(&wren_states_lock);
+	wren_state->last_used = apr_time_now();
+	wren_state->lock = false;
+	wren_state_unlocked(wren_state);
+	pthread_mutex_unlock(&wren_states_lock);
+}
+
+/**
+ * Sets a request's context aside and frees its VM for other requests while
+ * the request waits on a query. Its fibers keep their place in the VM, which
+ * isn't recycled, trimmed or unloaded until it resumes, and Web's statics
+ * go with it.
+ */
+static void wren_suspend_state(WrenState *wren_state,
+		WrenRequestContext *context)
+{
+	context->request_rec = wren_state->request_rec;
+	context->content_type = wren_state->content_type;
+	context->status_code = wren_state->status_code;
+	context->return_code = wren_state->return_code;
+	context->cookies = wren_state->cookies;
+	context->deadline = wren_state->deadline;
+	context->step_limit = wren_state->step_limit;
+	context->steps = wren_state->steps;
+	context->spans = wren_state->spans;
+	context->profile = wren_state->profile;
+	context->slow = wren_state->slow;
+	context->output = wren_state->output;
+	context->files = wren_state->files;
+	context->personal = wren_state->personal;
+	context->preloads = wren_state->preloads;
+	context->preloads_sent = wren_state->preloads_sent;
+	context->deferred = wren_state->deferred;
+	context->statics = wren_state->broken == false ?
+		wren_save_statics(wren_state) : NULL;
+
+	wren_active_state = NULL;
+	wren_metric_busy(wren_state->pool, -1);
+
+	pthread_mutex_lock(&wren_states_lock);
+	++wren_state->suspended;
+	wren_state->last_used = apr_time_now();
+	wren_state->lock = false;
+	wren_state_unlocked(wren_state);
+	pthread_mutex_unlock(&wren_states_lock);
+}
+
+/**
+ * Waits for a suspended request's VM to come free, then takes it back and
+ * restores the request's context.
+ */
+static void wren_resume_state(WrenState *wren_state,
+		WrenRequestContext *context)
+{
+	pthread_mutex_lock(&wren_states_lock);
+	++wren_state->resuming;
+
+	while(wren_state->lock == true) {
+		pthread_cond_wait(&wren_state->pool->resumable,
+				&wren_states_lock);
+	}
+
+	--wren_state->resuming;
+	--wren_state->suspended;
+	wren_state->lock = true;
+	pthread_mutex_unlock(&wren_states_lock);
+
+	wren_state->request_rec = context->request_rec;
+	wren_state->content_type = context->content_type;
+	wren_state->status_code = context->status_code;
+	wren_state->return_code = context->return_code;
+	wren_state->cookies = context->cookies;
+	wren_state->deadline = context->deadline;
+	wren_state->step_limit = context->step_limit;
+	wren_state->steps = context->steps;
+	wren_state->spans = context->spans;
+	wren_state->profile = context->profile;
+	wren_state->slow = context->slow;
+	wren_state->output = context->output;
+	wren_state->files = context->files;
+	wren_state->personal = context->personal;
+	wren_state->preloads = context->preloads;
+	wren_state->preloads_sent = context->preloads_sent;
+	wren_state->deferred = context->deferred;
+
+	wren_active_state = wren_state;
+	wren_metric_busy(wren_state->pool, 1);
+
+	/* Whoever had the VM meanwhile left Web's statics empty. */
+	wren_restore_statics(wren_state, context->statics);
+}
+
+/**
+ * Runs page code: 'compiled' if it's given, or else 'method' on whatever is in
+ * slot 0. An allocation refused by wren_heap_refuse() comes back here, and
+ * the run fails. Only the outermost run catches them.
+ */
+static WrenInterpretResult wren_run(WrenState *wren_state,
+		WrenHandle *compiled, WrenHandle *method)
+{
+	WrenInterpretResult result;
+	jmp_buf escape;
+
+	if(wren_state->escape != NULL) {
+		return compiled != NULL ? wrenRunCompiled(wren_state->vm, compiled) :
+			wrenCall(wren_state->vm, method);
+	}
+
+	if(setjmp(escape) != 0) {
+		wren_state->escape = NULL;
+		return WREN_RESULT_RUNTIME_ERROR;
+	}
+
+	wren_state->escape = &escape;
+	result = compiled != NULL ? wrenRunCompiled(wren_state->vm, compiled) :
+		wrenCall(wren_state->vm, method);
+	wren_state->escape = NULL;
+
+	return result;
+}
+
+/**
+ * Sees a page through the ModWrenAsyncDB queries it suspends itself for,
+ * giving up the VM while each batch runs, and returns how it finished. The
+ * list of each query's rows is handed back to the suspended fiber as the
+ * result of Fiber.suspend().
+ */
+static WrenInterpretResult wren_await_queries(WrenState *wren_state,
+		WrenInterpretResult result)
+{
+	while(result == WREN_RESULT_SUCCESS && wren_state->pending_fiber != NULL) {
+		WrenHandle *fiber = wren_state->pending_fiber;
+		apr_array_header_t *queries = wren_state->pending;
+		WrenRequestContext context;
+		WrenHandle *transfer;
+
+		wren_state->pending_fiber = NULL;
+		wren_state->pending = NULL;
+
+		wren_suspend_state(wren_state, &context);
+		wren_db_run_batch(queries, context.spans, context.request_rec->pool);
+		wren_resume_state(wren_state, &context);
+
+		/*
+		 * The fiber isn't running until it's handed its results, so a slow
+		 * request's line is caught as soon as it is, at the query.
+		 */
+		if(wren_state->slow != NULL && wren_state->slow->module == NULL)
+			wrenPollInterruptHandler(wren_state->vm);
+
+		transfer = wrenMakeCallHandle(wren_state->vm, "transfer(_)");
+
+		wrenEnsureSlots(wren_state->vm, 4);
+		wrenSetSlotHandle(wren_state->vm, 0, fiber);
+		wrenReleaseHandle(wren_state->vm, fiber);
+
+		wren_db_batch_to_list(wren_state, queries, 1);
+
+		result = wren_run(wren_state, NULL, transfer);
+		wrenReleaseHandle(wren_state->vm, transfer);
+	}
+
+	return result;
+}
+
+/**
+ * Resizes the given wren_buf to be larger than the current capacity.
+ *
+ * Hopefully PARSE_BUFFER_GROWTH_RATE is sensible enough that the number of
+ * times this happens is kept to a minimum.
+ */
+static void parse_grow_buffer(char **wren_buf, size_t *wren_index,
+		size_t *capacity)
+{
+	size_t new_capacity = *capacity * PARSE_BUFFER_GROWTH_RATE + 1;
+	char *new_buf = calloc(new_capacity, 1);
+
+	strncpy(new_buf, *wren_buf, *wren_index);
+
+	free(*wren_buf);
+	*wren_buf = new_buf;
+	*capacity = new_capacity;
+}
+
+/**
+ * Write the given write_str to the wren_buf, resizing if necessary and pushing
+ * wren_index along.
+ */
+static void parse_write(char **wren_buf, size_t *wren_index, size_t *capacity,
+		const char *write_str)
+{
+	size_t len = strlen(write_str);
+
+	while(*wren_index + len >= *capacity)
+		parse_grow_buffer(wren_buf, wren_index, capacity);
+
+	strncpy(*wren_buf + *wren_index, write_str, len);
+	*wren_index += len;
+}
+
+/**
+ * Copy write_len from buf to wren_buf, resizing wren_buf if necessary and
+ * pushing wren_index and buf_index along.
+ */
+static void parse_write_from_buf(char **wren_buf, size_t *wren_index,
+		size_t *capacity, const char *buf, size_t *buf_index, size_t write_len)
+{
+	while(*wren_index + write_len >= *capacity)
+		parse_grow_buffer(wren_buf, wren_index, capacity);
+
+	strncpy(*wren_buf + *wren_index, buf + *buf_index, write_len);
+	*buf_index += write_len;
+	*wren_index += write_len;
+}
+
+/**
+ * Open a System.write() string at the end of wren_buf. If nothing has been
+ * written since the last one closed at write_end, its string is reopened
+ * instead, so runs of HTML and expressions become a single call.
+ *
+ * Otherwise, if the code before it ended in a call, the write is appended to
+ * it to keep the line numbers in check.
+ */
+static void parse_open_write(char **wren_buf, size_t *wren_index,
+		size_t *capacity, size_t write_end)
+{
+	if(write_end > 0 && *wren_index == write_end) {
+		*wren_index -= 2; /* The closing "). */
+		return;
+	}
+
+	bool prev_was_call = *(*wren_buf + *wren_index - 1) == ')';
+	parse_write(wren_buf, wren_index, capacity,
+			prev_was_call ? "+System.write(\"" : "System.write(\"");
+}
+
+/**
+ * Write an HTML block inside the file_buf, starting from file_index,
+ * to the output wren_buf, starting at wren_index.
+ *
+ * file_index will get progressed by html_len, the amount of raw HTML
+ * within the file. wren_index will get progressed a bit more, html_len plus
+ * extra characters for function calls and escaping.
+ */
+static void parse_write_html(char **wren_buf, size_t *wren_index,
+		size_t *wren_capacity, size_t *write_end, const char *file_buf,
+		size_t *file_index, size_t html_len)
+{
+	if(html_len == 0 || (html_len == 1 && *(file_buf + *file_index) == '\n'))
+		return;
+
+	parse_open_write(wren_buf, wren_index, wren_capacity, *write_end);
+
+	/*
+	 * Write the actual HTML segment to the buffer, escaping forbidden
+	 * characters as we go.
+	 *
+	 * This isn't the most elegantly written thing in the world.
+	 */
+	char *next_quote   = strchr(file_buf + *file_index, '"')  ?: (char*)INTPTR_MAX;
+	char *next_percent = strchr(file_buf + *file_index, '%')  ?: (char*)INTPTR_MAX;
+	char *next_slash   = strchr(file_buf + *file_index, '\\') ?: (char*)INTPTR_MAX;
+
+	do {
+		char *next_char = MIN(next_quote, MIN(next_percent, next_slash));
+
+		if(next_char > file_buf + (*file_index) + html_len)
+			break;
+
+		size_t segment_len = next_char - (file_buf + *file_index);
+
+		parse_write_from_buf(wren_buf, wren_index, wren_capacity, file_buf,
+				file_index, segment_len);
+
+		parse_write(wren_buf, wren_index, wren_capacity, "\\");
+		html_len -= segment_len;
+
+		next_quote   = strchr(file_buf + *file_index + 1, '"')  ?: (char*)INTPTR_MAX;
+		next_percent = strchr(file_buf + *file_index + 1, '%')  ?: (char*)INTPTR_MAX;
+		next_slash   = strchr(file_buf + *file_index + 1, '\\') ?: (char*)INTPTR_MAX;
+	} while(html_len > 0);
+
+	parse_write_from_buf(wren_buf, wren_index, wren_capacity, file_buf,
+			file_index, html_len);
+
+	/* Close up the System.write. */
+	parse_write(wren_buf, wren_index, wren_capacity, "\")");
+	*write_end = *wren_index;
+}
+
+/**
+ * Reads a page into a buffer with two spare bytes either side of it, so raw
+ * Wren can be wrapped in braces where it is. The page starts at file_buf + 2.
+ *
+ * Returns OK with file_buf allocated on success, otherwise a failing HTTP
+ * code with no allocation.
+ */
+static int wren_read_page(const char *filename, char **file_buf,
+		size_t *file_len)
+{
+	FILE *file = fopen(filename, "r");
+	size_t read_len;
+
+	if(file == NULL)
+		return errno == ENOENT ? HTTP_NOT_FOUND : HTTP_INTERNAL_SERVER_ERROR;
+
+	fseek(file, 0, SEEK_END);
+	*file_len = ftell(file) ?: 1;
+	fseek(file, 0, SEEK_SET);
+
+	*file_buf = malloc(*file_len + 5);
+	read_len = fread(*file_buf + 2, 1, *file_len, file);
+	(*file_buf)[*file_len + 2] = '\0';
+	fclose(file);
+
+	if(read_len != *file_len) {
+		free(*file_buf);
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	return OK;
+}
+
+/**
+ * Whether a page read by wren_read_page() is plain HTML, with no Wren in it.
+ */
+static bool wren_page_is_static(const char *file_buf)
+{
+	return strstr(file_buf + 2, TAG_BLOCK_OPEN) == NULL &&
+		strstr(file_buf + 2, TAG_EXPR_OPEN) == NULL;
+}
+
+/**
+ * Translate a page read by wren_read_page(), looking for Wren code blocks,
+ * Wren expressions, and regular HTML.
+ *
+ * Wren blocks (<?wren ... ?>) get inserted straight into the output buffer.
+ *
+ * Wren expressions (<%= ... %>) get interpolated into a write
+ * (System.write("%(...)")).
+ *
+ * The rest is regular HTML, which gets its special characters escaped before
+ * being placed in a System.write("...") call. HTML and expressions with
+ * nothing between them share one write.
+ *
+ * Takes ownership of file_buf, and returns the Wren code.
+ */
+static char* wren_translate(char *file_buf, size_t file_len, bool raw)
+{
+	char *out_buf;
+
+	/*
+	 * We want to accept the whole file as Wren without parsing, so we wrap it
+	 * in its own scope and send it on its way.
+	 */
+	if(raw == true) {
+		file_buf[0] = '{';
+		file_buf[1] = '\n';
+		file_buf[file_len + 2] = '\n';
+		file_buf[file_len + 3] = '}';
+		file_buf[file_len + 4] = '\0';
+
+		return file_buf;
+	}
+
+	/*
+	 * Allocate another buffer for the output Wren code. This needs to be
+	 * bigger than the input to account for the function calls and escaping
+	 * we add.
+	 */
+	size_t file_index = 2;
+	size_t out_index = 0;
+	size_t out_capacity = MIN(128, file_len * PARSE_BUFFER_GROWTH_RATE);
+	size_t write_end = 0; /* Where the last System.write() closed. */
+
+	out_buf = malloc(out_capacity);
+	parse_write(&out_buf, &out_index, &out_capacity, "{\n");
+
+	/*
+	 * Go through the file looking for Wren tags and converting HTML blocks to
+	 * Wren System.write statements.
+	 */
+	while(file_index < file_len + 2) {
+		char *next_block_open = strstr(
+				file_buf + file_index, TAG_BLOCK_OPEN) ?: (char*)INTPTR_MAX;
+		char *next_expr_open = strstr(
+				file_buf + file_index, TAG_EXPR_OPEN) ?: (char*)INTPTR_MAX;
+
+		/*
+		 * There are no more Wren segments to parse. Add the rest to the output
+		 * buffer as HTML.
+		 */
+		if(next_block_open == (char*)INTPTR_MAX &&
+				next_expr_open == (char*)INTPTR_MAX)
+		{
+
+			size_t html_len = file_len + 2 - file_index;
+			parse_write_html(&out_buf, &out_index, &out_capacity, &write_end,
+					file_buf, &file_index, html_len);
+			break;
+		}
+
+		/*
+		 * Otherwise, we've hit a Wren segment.
+		 *
+		 * This could be a Wren code block (<?wren ... ?>) or an expression
+		 * (<%= ... %>), so we check for which tag we've hit. If we're in
+		 * an expression, we wrap it in a System.write("%(...))".
+		 */
+		bool expr = next_block_open > next_expr_open ? true : false;
+		char *next             = expr ? next_expr_open     : next_block_open;
+		char *closing_tag      = expr ? TAG_EXPR_CLOSE     : TAG_BLOCK_CLOSE;
+		size_t opening_tag_len = expr ? TAG_EXPR_OPEN_LEN  : TAG_BLOCK_OPEN_LEN;
+		size_t closing_tag_len = expr ? TAG_EXPR_CLOSE_LEN : TAG_BLOCK_CLOSE_LEN;
+
+		if(next > file_buf + file_index) {
+			size_t html_len = next - (file_buf + file_index);
+			parse_write_html(&out_buf, &out_index, &out_capacity, &write_end,
+					file_buf, &file_index, html_len);
+		}
+
+		file_index += opening_tag_len + 1;
+		char *closing_tag_pos = strstr(file_buf + file_index, closing_tag);
+
+		if(closing_tag_pos == NULL) {
+			/*
+			 * Mismatched opening/closing tag. This should probably be handled,
+			 * but for now, just let Wren fail.
+			 */
+			break;
+		}
+
+		if(expr == true) {
+			parse_open_write(&out_buf, &out_index, &out_capacity, write_end);
+			parse_write(&out_buf, &out_index, &out_capacity, "%(");
+		}
+		else {
+			/* A full code block belongs on its own line. */
+			parse_write(&out_buf, &out_index, &out_capacity, "\n");
+		}
+
+		/*
+		 * Write out whatever we found in our Wren tags and push the file read
+		 * index along to the end of the closing tag.
+		 */
+		size_t write_len = closing_tag_pos - (file_buf + file_index);
+		parse_write_from_buf(&out_buf, &out_index, &out_capacity, file_buf,
+				&file_index, write_len);
+
+		if(expr == true) {
+			parse_write(&out_buf, &out_index, &out_capacity, ")\")");
+			write_end = out_index;
+		}
+
+		file_index += closing_tag_len;
+	}
+
+	parse_write(&out_buf, &out_index, &out_capacity, "\n}");
+
+	out_buf[out_index] = '\0';
+
+	free(file_buf);
+	return out_buf;
+}
+
+/**
+ * Reads and translates the page at filename.
+ *
+ * Returns OK with wren_code allocated on success, otherwise a failing HTTP
+ * code with no allocation.
+ */
+static int wren_parse_file(const char *filename, char **wren_code, bool raw)
+{
+	char *file_buf;
+	size_t file_len;
+	int ret;
+
+	if((ret = wren_read_page(filename, &file_buf, &file_len)) != OK)
+		return ret;
+
+	*wren_code = wren_translate(file_buf, file_len, raw);
+	return OK;
+}
+
+/**
+ * Parses the requested page.
+ */
+static int wren_parse(WrenState *wren_state, char **wren_code, bool raw)
+{
+	return wren_parse_file(wren_state->request_rec->canonical_filename,
+			wren_code, raw);
+}
+
+/**
+ * Returns the ModWrenCompileCache file for a module's code, named for a hash
+ * of the code and the Wren build.
+ */
+static const char* wren_cache_path(apr_pool_t *pool, const char *module,
+		const char *source)
+{
+	unsigned char digest[APR_MD5_DIGESTSIZE];
+	char hex[APR_MD5_DIGESTSIZE * 2 + 1];
+	apr_md5_ctx_t md5;
+
+	apr_md5_init(&md5);
+	apr_md5_update(&md5, WREN_STRINGIFY(WREN_BUILD_ID),
+			sizeof(WREN_STRINGIFY(WREN_BUILD_ID)));
+	apr_md5_update(&md5, module, strlen(module) + 1);
+	apr_md5_update(&md5, source, strlen(source));
+	apr_md5_final(digest, &md5);
+
+	for(size_t i = 0; i < APR_MD5_DIGESTSIZE; ++i)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	return apr_pstrcat(pool, wren_cache_dir, "/", hex, ".wrenc", NULL);
+}
+
+/**
+ * WrenWriteBytesFn for writing serialized code to a cache file.
+ */
+static void wren_cache_write(void *user_data, const char *bytes, size_t length)
+{
+	fwrite(bytes, 1, length, (FILE*)user_data);
+}
+
+/**
+ * Saves compiled code to the cache. It's written to a temporary file and
+ * renamed into place, so other children never load a partial file.
+ */
+static void wren_cache_save(WrenState *wren_state, WrenHandle *compiled,
+		const char *path)
+{
+	request_rec *r = wren_state->request_rec;
+	char *temp_path = apr_pstrcat(r->pool, path, ".XXXXXX", NULL);
+	int fd = mkstemp(temp_path);
+	FILE *file;
+	bool saved;
+
+	if(fd == -1 || (file = fdopen(fd, "wb")) == NULL) {
+		ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_WARNING, errno, r,
+				"Couldn't write to the compile cache %s", wren_cache_dir);
+
+		if(fd != -1) {
+			close(fd);
+			unlink(temp_path);
+		}
+
+		return;
+	}
+
+	saved = wrenSerializeCompiled(wren_state->vm, compiled, wren_cache_write,
+			file);
+	saved = ferror(file) == 0 && fclose(file) == 0 && saved;
+
+	if(saved == false || rename(temp_path, path) != 0)
+		unlink(temp_path);
+}
+
+/**
+ * Compiles a module's code, or loads it from ModWrenCompileCache if it's been
+ * compiled before. Returns NULL if the code doesn't compile.
+ */
+static WrenHandle* wren_compile(WrenState *wren_state, const char *module,
+		const char *source)
+{
+	request_rec *r = wren_state->request_rec;
+	WrenHandle *compiled = NULL;
+	const char *path;
+	FILE *file;
+
+	if(wren_cache_dir == NULL)
+		return wrenCompileInModule(wren_state->vm, module, source);
+
+	path = wren_cache_path(r->pool, module, source);
+
+	if((file = fopen(path, "rb")) != NULL) {
+		long length;
+		char *bytes;
+
+		fseek(file, 0, SEEK_END);
+		length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		bytes = apr_palloc(r->pool, MAX(length, 1));
+
+		if(length > 0 && fread(bytes, 1, length, file) == (size_t)length) {
+			compiled = wrenDeserializeCompiled(wren_state->vm, module, bytes,
+					length);
+		}
+
+		fclose(file);
+	}
+
+	if(compiled != NULL) {
+		WREN_METRIC_ADD(compile_cache_hits, 1);
+		return compiled;
+	}
+
+	WREN_METRIC_ADD(compile_cache_misses, 1);
+
+	if((compiled = wrenCompileInModule(wren_state->vm, module, source)) != NULL)
+		wren_cache_save(wren_state, compiled, path);
+
+	return compiled;
+}
+
+/**
+ * Compresses 'len' bytes with gzip into 'pool'. Returns NULL if that fails.
+ */
+static const char* wren_gzip(apr_pool_t *pool, const char *data,
+		apr_size_t len, apr_size_t *out_len)
+{
+	z_stream stream;
+	char *out;
+	int status;
+
+	memset(&stream, 0x0, sizeof(stream));
+
+	/* Adding 16 to the window bits asks for a gzip header and trailer. */
+	if(deflateInit2(&stream, WREN_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return NULL;
+	}
+
+	*out_len = deflateBound(&stream, len);
+	out = apr_palloc(pool, *out_len);
+
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = len;
+	stream.next_out = (Bytef*)out;
+	stream.avail_out = *out_len;
+
+	status = deflate(&stream, Z_FINISH);
+	*out_len = stream.total_out;
+	deflateEnd(&stream);
+
+	return status == Z_STREAM_END ? out : NULL;
+}
+
+/**
+ * Compresses 'len' bytes with Brotli into 'pool'. Returns NULL if that fails,
+ * or if mod_wren was built without Brotli.
+ */
+static const char* wren_brotli(apr_pool_t *pool, const char *data,
+		apr_size_t len, apr_size_t *out_len)
+{
+#ifdef HAVE_BROTLI
+	size_t size = BrotliEncoderMaxCompressedSize(len);
+	uint8_t *out;
+
+	if(size == 0)
+		return NULL;
+
+	out = apr_palloc(pool, size);
+
+	if(BrotliEncoderCompress(WREN_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+				BROTLI_MODE_TEXT, len, (const uint8_t*)data, &size, out) ==
+			BROTLI_FALSE)
+	{
+		return NULL;
+	}
+
+	*out_len = size;
+
+	return (const char*)out;
+#else
+	return NULL;
+#endif
+}
+
+/**
+ * Returns true if an Accept-Encoding header accepts 'coding', either by name
+ * or through "*", with a nonzero quality.
+ */
+static bool wren_accepts_encoding(apr_pool_t *pool, const char *header,
+		const char *coding)
+{
+	char *list, *state, *token;
+	double star = 0;
+
+	if(header == NULL)
+		return false;
+
+	list = apr_pstrdup(pool, header);
+
+	for(token = apr_strtok(list, ",", &state); token != NULL;
+			token = apr_strtok(NULL, ",", &state))
+	{
+		char *params = strchr(token, ';');
+		const char *q;
+		double quality = 1;
+
+		if(params != NULL) {
+			*params++ = '\0';
+
+			if((q = strstr(params, "q=")) != NULL)
+				quality = atof(q + 2);
+		}
+
+		apr_collapse_spaces(token, token);
+
+		if(strcasecmp(token, coding) == 0)
+			return quality > 0;
+
+		if(strcmp(token, "*") == 0)
+			star = quality;
+	}
+
+	return star > 0;
+}
+
+/**
+ * Drops an entry from the output cache. Its pool goes once nothing is
+ * sending it. Called with wren_output_cache_lock held.
+ */
+static void wren_output_cache_evict(WrenCachedOutput *entry)
+{
+	apr_hash_set(wren_output_cache, entry->key, APR_HASH_KEY_STRING, NULL);
+	wren_output_cache_bytes -= entry->size;
+	entry->evicted = true;
+
+	if(entry->refs == 0)
+		apr_pool_destroy(entry->pool);
+}
+
+/**
+ * Returns the cached output for 'key' if there's any that hasn't expired,
+ * to be handed back with wren_output_cache_release() once it's been sent.
+ */
+static WrenCachedOutput* wren_output_cache_get(const char *key)
+{
+	WrenCachedOutput *entry;
+
+	pthread_mutex_lock(&wren_output_cache_lock);
+
+	entry = apr_hash_get(wren_output_cache, key, APR_HASH_KEY_STRING);
+
+	if(entry != NULL && entry->expires <= apr_time_now()) {
+		wren_output_cache_evict(entry);
+		entry = NULL;
+	}
+
+	if(entry != NULL)
+		++entry->refs;
+
+	pthread_mutex_unlock(&wren_output_cache_lock);
+
+	return entry;
+}
+
+static void wren_output_cache_release(WrenCachedOutput *entry)
+{
+	pthread_mutex_lock(&wren_output_cache_lock);
+
+	if(--entry->refs == 0 && entry->evicted == true)
+		apr_pool_destroy(entry->pool);
+
+	pthread_mutex_unlock(&wren_output_cache_lock);
+}
+
+/**
+ * Caches a page's output, along with its content type and headers, for
+ * 'ttl'. Each encoding is compressed once here rather than on every
+ * response.
+ *
+ * Returns the new entry, to be released as wren_output_cache_get()'s are, or
+ * NULL if the cache is too full to hold it.
+ */
+static WrenCachedOutput* wren_output_cache_store(request_rec *r,
+		const char *key, const char *body, apr_size_t len,
+		apr_interval_time_t ttl)
+{
+	const char *bodies[WREN_NUM_ENCODINGS] = { body };
+	apr_size_t lens[WREN_NUM_ENCODINGS] = { len };
+	apr_size_t size = len;
+	WrenCachedOutput *entry, *existing;
+	apr_pool_t *pool;
+
+	/* Compressed before taking the lock, since it's the slow part. */
+	if(len >= WREN_COMPRESS_MIN) {
+		bodies[WREN_ENCODING_GZIP] = wren_gzip(r->pool, body, len,
+				&lens[WREN_ENCODING_GZIP]);
+		bodies[WREN_ENCODING_BROTLI] = wren_brotli(r->pool, body, len,
+				&lens[WREN_ENCODING_BROTLI]);
+	}
+
+	for(int i = 1; i < WREN_NUM_ENCODINGS; ++i) {
+		if(bodies[i] != NULL && lens[i] >= len)
+			bodies[i] = NULL;
+
+		if(bodies[i] != NULL)
+			size += lens[i];
+	}
+
+	pthread_mutex_lock(&wren_output_cache_lock);
+
+	existing = apr_hash_get(wren_output_cache, key, APR_HASH_KEY_STRING);
+
+	if(existing != NULL)
+		wren_output_cache_evict(existing);
+
+	/* Make room by dropping whatever has expired. */
+	if(wren_output_cache_bytes + size > wren_output_cache_size) {
+		apr_time_t now = apr_time_now();
+
+		for(apr_hash_index_t *i = apr_hash_first(NULL, wren_output_cache);
+				i != NULL; i = apr_hash_next(i))
+		{
+			WrenCachedOutput *cached = apr_hash_this_val(i);
+
+			if(cached->expires <= now)
+				wren_output_cache_evict(cached);
+		}
+	}
+
+	if(wren_output_cache_bytes + size > wren_output_cache_size) {
+		pthread_mutex_unlock(&wren_output_cache_lock);
+		return NULL;
+	}
+
+	apr_pool_create(&pool, wren_output_cache_pool);
+
+	entry = apr_pcalloc(pool, sizeof(WrenCachedOutput));
+	entry->pool = pool;
+	entry->key = apr_pstrdup(pool, key);
+	entry->expires = apr_time_now() + ttl;
+	entry->content_type = apr_pstrdup(pool, r->content_type);
+	entry->headers = apr_table_copy(pool, r->headers_out);
+	entry->size = size;
+	entry->refs = 1;
+
+	for(int i = 0; i < WREN_NUM_ENCODINGS; ++i) {
+		if(bodies[i] != NULL) {
+			entry->bodies[i].data = apr_pmemdup(pool, bodies[i], lens[i]);
+			entry->bodies[i].len = lens[i];
+		}
+	}
+
+	apr_hash_set(wren_output_cache, entry->key, APR_HASH_KEY_STRING, entry);
+	wren_output_cache_bytes += size;
+
+	pthread_mutex_unlock(&wren_output_cache_lock);
+
+	return entry;
+}
+
+static int wren_output_cache_copy_header(void *data, const char *key,
+		const char *value)
+{
+	apr_table_set(((request_rec*)data)->headers_out, key, value);
+
+	return 1;
+}
+
+/**
+ * Sends cached output in the best encoding the client accepts.
+ */
+static void wren_output_cache_send(request_rec *r, WrenCachedOutput *entry)
+{
+	const char *accept = apr_table_get(r->headers_in, "Accept-Encoding");
+	WrenEncoding encoding = WREN_ENCODING_IDENTITY;
+	bool encoded = false;
+
+	for(int i = WREN_NUM_ENCODINGS - 1; i > WREN_ENCODING_IDENTITY; --i) {
+		if(entry->bodies[i].data == NULL)
+			continue;
+
+		encoded = true;
+
+		if(encoding == WREN_ENCODING_IDENTITY &&
+				wren_accepts_encoding(r->pool, accept, wren_encoding_names[i]))
+		{
+			encoding = i;
+		}
+	}
+
+	apr_table_do(wren_output_cache_copy_header, r, entry->headers, NULL);
+
+	/* Caches in front of us need to know the body depends on the header. */
+	if(encoded == true)
+		apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+
+	if(encoding != WREN_ENCODING_IDENTITY) {
+		apr_table_setn(r->headers_out, "Content-Encoding",
+				wren_encoding_names[encoding]);
+	}
+
+	ap_set_content_type(r, apr_pstrdup(r->pool, entry->content_type));
+	r->status = HTTP_OK;
+	ap_set_content_length(r, entry->bodies[encoding].len);
+
+	if(r->header_only == 0)
+		ap_rwrite(entry->bodies[encoding].data, entry->bodies[encoding].len, r);
+}
+
+/**
+ * Adds the Server-Timing header, giving the time spent in each phase of the
+ * request in milliseconds. The collection is part of release, so it isn't
+ * listed separately.
+ */
+static void wren_set_server_timing(request_rec *r, apr_array_header_t *spans)
+{
+	static const WrenPhase phases[] = {
+		WREN_PHASE_ACQUIRE, WREN_PHASE_PARSE, WREN_PHASE_COMPILE,
+		WREN_PHASE_EXECUTE, WREN_PHASE_DB, WREN_PHASE_RELEASE
+	};
+	apr_interval_time_t totals[WREN_NUM_PHASES] = { 0 };
+	const WrenSpan *span = (const WrenSpan*)spans->elts;
+	char *header = "";
+
+	/*
+	 * A page that wrote more than Apache buffers has already sent its
+	 * headers, so it only gets the span log.
+	 */
+	if(r->sent_bodyct)
+		return;
+
+	for(int i = 0; i < spans->nelts; ++i)
+		totals[span[i].phase] += span[i].end - span[i].start;
+
+	for(size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+		header = apr_psprintf(r->pool, "%s%s%s;dur=%.3f", header,
+				i > 0 ? ", " : "", wren_phase_names[phases[i]],
+				totals[phases[i]] / 1000.0);
+	}
+
+	apr_table_merge(r->headers_out, "Server-Timing", header);
+}
+
+/**
+ * Returns str as the contents of a JSON string.
+ */
+static const char* wren_json_escape(apr_pool_t *pool, const char *str)
+{
+	char *out = apr_palloc(pool, strlen(str) * 6 + 1);
+	char *o = out;
+
+	for(const unsigned char *c = (const unsigned char*)str; *c != '\0'; ++c) {
+		if(*c == '"' || *c == '\\') {
+			*o++ = '\\';
+			*o++ = *c;
+		} else if(*c < 0x20) {
+			o += sprintf(o, "\\u%04x", *c);
+		} else {
+			*o++ = *c;
+		}
+	}
+
+	*o = '\0';
+
+	return out;
+}
+
+/**
+ * Writes len random bytes into buf as hex.
+ */
+static void wren_random_hex(char *buf, size_t len)
+{
+	unsigned char bytes[16];
+
+	apr_generate_random_bytes(bytes, len);
+
+	for(size_t i = 0; i < len; ++i)
+		sprintf(buf + i * 2, "%02x", bytes[i]);
+}
+
+/**
+ * Whether the len characters at str are all lowercase hex.
+ */
+static bool wren_is_lower_hex(const char *str, size_t len)
+{
+	for(size_t i = 0; i < len; ++i) {
+		if(!apr_isxdigit(str[i]) || apr_isupper(str[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Reads the trace and parent ids from a W3C traceparent header,
+ * "<version>-<trace id>-<parent id>-<flags>". Headers that don't follow Trace
+ * Context are ignored, so nothing from them reaches the span log.
+ */
+static bool wren_parse_traceparent(const char *traceparent, char *trace_id,
+		char *parent_id)
+{
+	size_t len;
+
+	if(traceparent == NULL)
+		return false;
+
+	len = strlen(traceparent);
+
+	/* Later versions may add fields after the flags, but version 00 can't. */
+	if(len < 55 || (len > 55 && (strncmp(traceparent, "00", 2) == 0 ||
+			traceparent[55] != '-')))
+		return false;
+
+	if(traceparent[2] != '-' || traceparent[35] != '-' ||
+			traceparent[52] != '-')
+		return false;
+
+	/* Version ff is invalid, as are ids of all zeros. */
+	if(!wren_is_lower_hex(traceparent, 2) ||
+			strncmp(traceparent, "ff", 2) == 0 ||
+			!wren_is_lower_hex(traceparent + 3, 32) ||
+			strspn(traceparent + 3, "0") >= 32 ||
+			!wren_is_lower_hex(traceparent + 36, 16) ||
+			strspn(traceparent + 36, "0") >= 16 ||
+			!wren_is_lower_hex(traceparent + 53, 2))
+		return false;
+
+	apr_cpystrn(trace_id, traceparent + 3, 33);
+	apr_cpystrn(parent_id, traceparent + 36, 17);
+
+	return true;
+}
+
+/**
+ * Appends the request to the span log as one line of OpenTelemetry's JSON
+ * trace format: a server span for the whole request, with a child for each
+ * phase. Database statements are children of the execute span, and the
+ * collection a child of release.
+ *
+ * A W3C traceparent header on the request makes this span part of the
+ * caller's trace.
+ */
+static void wren_log_spans(request_rec *r, apr_array_header_t *spans,
+		apr_time_t start, int ret)
+{
+	const WrenSpan *span = (const WrenSpan*)spans->elts;
+	const char *traceparent = apr_table_get(r->headers_in, "traceparent");
+	apr_array_header_t *out = apr_array_make(r->pool, spans->nelts * 8 + 8,
+			sizeof(const char*));
+	char trace_id[33], root_id[17], parent_id[17] = "";
+	char (*span_ids)[17] = apr_palloc(r->pool, spans->nelts * 17);
+	int *owners = apr_palloc(r->pool, spans->nelts * sizeof(int));
+	int owner = -1, release = -1;
+	int status = ret == OK ? r->status : ret;
+	const char *line;
+	apr_size_t written;
+
+	/* A malformed header starts a trace of its own. */
+	if(wren_parse_traceparent(traceparent, trace_id, parent_id) == false) {
+		wren_random_hex(trace_id, 16);
+		parent_id[0] = '\0';
+	}
+
+	wren_random_hex(root_id, 8);
+
+	for(int i = 0; i < spans->nelts; ++i) {
+		wren_random_hex(span_ids[i], 8);
+
+		if(span[i].phase == WREN_PHASE_RELEASE)
+			release = i;
+	}
+
+	/*
+	 * A span is recorded as it ends, so a statement's span comes before that
+	 * of the execute or deferred work it ran in.
+	 */
+	for(int i = spans->nelts - 1; i >= 0; --i) {
+		if(span[i].phase == WREN_PHASE_EXECUTE ||
+				span[i].phase == WREN_PHASE_DEFER)
+			owner = i;
+
+		owners[i] = owner;
+	}
+
+	#define WREN_SPAN_PUSH(str) (APR_ARRAY_PUSH(out, const char*) = (str))
+
+	WREN_SPAN_PUSH(apr_psprintf(r->pool,
+			"{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+			"{\"key\":\"service.name\",\"value\":{\"stringValue\":\"mod_wren\"}},"
+			"{\"key\":\"host.name\",\"value\":{\"stringValue\":\"%s\"}}]},"
+			"\"scopeSpans\":[{\"scope\":{\"name\":\"mod_wren\"},\"spans\":["
+			"{\"traceId\":\"%s\",\"spanId\":\"%s\",\"parentSpanId\":\"%s\","
+			"\"name\":\"%s %s\",\"kind\":2,"
+			"\"startTimeUnixNano\":\"%" APR_TIME_T_FMT "000\","
+			"\"endTimeUnixNano\":\"%" APR_TIME_T_FMT "000\","
+			"\"attributes\":["
+			"{\"key\":\"http.request.method\",\"value\":{\"stringValue\":\"%s\"}},"
+			"{\"key\":\"url.path\",\"value\":{\"stringValue\":\"%s\"}},"
+			"{\"key\":\"http.response.status_code\",\"value\":{\"intValue\":%d}}"
+			"],\"status\":{\"code\":%d}}",
+			wren_json_escape(r->pool, r->server->server_hostname ?: ""),
+			trace_id, root_id, parent_id,
+			wren_json_escape(r->pool, r->method),
+			wren_json_escape(r->pool, r->uri), start, apr_time_now(),
+			wren_json_escape(r->pool, r->method),
+			wren_json_escape(r->pool, r->uri), status, status >= 500 ? 2 : 0));
+
+	for(int i = 0; i < spans->nelts; ++i) {
+		const char *parent = root_id;
+
+		if(span[i].phase == WREN_PHASE_DB && owners[i] != -1)
+			parent = span_ids[owners[i]];
+		else if(span[i].phase == WREN_PHASE_GC && release != -1)
+			parent = span_ids[release];
+
+		WREN_SPAN_PUSH(apr_psprintf(r->pool,
+				",{\"traceId\":\"%s\",\"spanId\":\"%s\",\"parentSpanId\":\"%s\","
+				"\"name\":\"%s\",\"kind\":%d,"
+				"\"startTimeUnixNano\":\"%" APR_TIME_T_FMT "000\","
+				"\"endTimeUnixNano\":\"%" APR_TIME_T_FMT "000\"",
+				trace_id, span_ids[i], parent, wren_phase_names[span[i].phase],
+				span[i].phase == WREN_PHASE_DB ? 3 : 1,
+				span[i].start, span[i].end));
+
+		if(span[i].sql != NULL) {
+			WREN_SPAN_PUSH(apr_psprintf(r->pool,
+					",\"attributes\":[{\"key\":\"db.query.text\","
+					"\"value\":{\"stringValue\":\"%s\"}}]",
+					wren_json_escape(r->pool, span[i].sql)));
+		}
+
+		WREN_SPAN_PUSH(span[i].failed ? ",\"status\":{\"code\":2}}" : "}");
+	}
+
+	WREN_SPAN_PUSH("]}]}]}\n");
+
+	#undef WREN_SPAN_PUSH
+
+	/*
+	 * The log is opened for appending, so each line goes out in one write
+	 * and lines from different children don't interleave.
+	 */
+	line = apr_array_pstrcat(r->pool, out, 0);
+	apr_file_write_full(wren_span_log, line, strlen(line), &written);
+}
+
+/**
+ * Appends a request that took longer than ModWrenSlowLog's threshold to the
+ * slow log, as one line of JSON: how long it spent in each phase in
+ * milliseconds, every database statement it ran, the VM's heap either side of
+ * it, and the line of the page it was on when it became slow.
+ */
+static void wren_log_slow(request_rec *r, apr_array_header_t *spans,
+		WrenSlow *slow, apr_time_t start, int ret)
+{
+	const WrenSpan *span = (const WrenSpan*)spans->elts;
+	apr_interval_time_t totals[WREN_NUM_PHASES] = { 0 };
+	apr_time_t end = apr_time_now();
+	apr_array_header_t *out;
+	const char *line;
+	apr_size_t written;
+
+	if(end - start < wren_slow_log_threshold)
+		return;
+
+	out = apr_array_make(r->pool, spans->nelts + WREN_NUM_PHASES + 8,
+			sizeof(const char*));
+
+	#define WREN_SLOW_PUSH(str) (APR_ARRAY_PUSH(out, const char*) = (str))
+
+	WREN_SLOW_PUSH(apr_psprintf(r->pool,
+			"{\"time\":%" APR_TIME_T_FMT ",\"method\":\"%s\",\"uri\":\"%s\","
+			"\"status\":%d,\"pool\":\"%s\",\"duration\":%.3f,\"phases\":{",
+			start, wren_json_escape(r->pool, r->method),
+			wren_json_escape(r->pool, r->uri),
+			ret != OK ? ret : r->status, wren_json_escape(r->pool, slow->pool),
+			(end - start) / 1000.0));
+
+	for(int i = 0; i < spans->nelts; ++i)
+		totals[span[i].phase] += span[i].end - span[i].start;
+
+	/* Acquiring is the wait for a VM from the pool. */
+	for(int i = 0; i < WREN_NUM_PHASES; ++i) {
+		WREN_SLOW_PUSH(apr_psprintf(r->pool, "%s\"%s\":%.3f", i > 0 ? "," : "",
+				wren_phase_names[i], totals[i] / 1000.0));
+	}
+
+	WREN_SLOW_PUSH("},\"queries\":[");
+
+	for(int i = 0, n = 0; i < spans->nelts; ++i) {
+		if(span[i].phase != WREN_PHASE_DB)
+			continue;
+
+		WREN_SLOW_PUSH(apr_psprintf(r->pool,
+				"%s{\"sql\":\"%s\",\"offset\":%.3f,\"duration\":%.3f,"
+				"\"failed\":%s}", n++ > 0 ? "," : "",
+				wren_json_escape(r->pool, span[i].sql ?: ""),
+				(span[i].start - start) / 1000.0,
+				(span[i].end - span[i].start) / 1000.0,
+				span[i].failed ? "true" : "false"));
+	}
+
+	WREN_SLOW_PUSH(apr_psprintf(r->pool,
+			"],\"heap\":{\"before\":%zu,\"after\":%zu},\"line\":",
+			slow->heap_before, slow->heap_after));
+
+	/* Slow before it ran any Wren, or only in waits the VM wasn't part of. */
+	if(slow->module == NULL) {
+		WREN_SLOW_PUSH("null}\n");
+	} else {
+		WREN_SLOW_PUSH(apr_psprintf(r->pool,
+				"{\"module\":\"%s\",\"function\":\"%s\",\"line\":%d}}\n",
+				wren_json_escape(r->pool, slow->module),
+				wren_json_escape(r->pool, slow->function), slow->line));
+	}
+
+	#undef WREN_SLOW_PUSH
+
+	/* One write, so requests from different children don't interleave. */
+	line = apr_array_pstrcat(r->pool, out, 0);
+	apr_file_write_full(wren_slow_log, line, strlen(line), &written);
+}
+
+/* Defined with wren_log_transaction(), below. */
+static void wren_run_deferred(WrenState *wren_state);
+static apr_status_t wren_deferred_cleanup(void *data);
+
+/**
+ * Main Wren handler that gets hooked when we call a Wren file, and converts
+ * the file to something that can be understood by the WrenVM and runs it.
+ */
+static int wren_handler(request_rec *r)
+{
+	WrenState *wren_state;
+	WrenDirConfig *conf;
+	apr_array_header_t *spans;
+	WrenSlow *slow;
+	apr_bucket_brigade *output = NULL;
+	WrenCachedOutput *cached = NULL;
+	const char *cache_key = NULL;
+	char *file_buf, *wren_code = NULL;
+	size_t file_len;
+	bool failed = true;
+	int ret = OK;
+
+	/*
+	 * If the file extension is .wren, we'll use the raw file as Wren code.
+	 * Otherwise we'll parse it as mixed HTML/Wren.
+	 */
+	bool raw_wren = ({
+		const char *file_extension = strrchr(r->canonical_filename, '.');
+		strcmp(file_extension ?: "", ".wren") == 0;
+	});
+
+	/* Make sure the request is for us. */
+	if(strcmp(r->handler ?: "", "wren") != 0)
+		return DECLINED;
+
+	/* TODO: allow other methods (most critically, POST). */
+	if(r->method_number != M_GET &&
+			r->method_number != M_POST &&
+			r->method_number != M_PUT &&
+			r->method_number != M_DELETE)
+	{
+		return HTTP_METHOD_NOT_ALLOWED;
+	}
+
+	WREN_METRIC_ADD(requests, 1);
+
+	/*
+	 * Output is only cached for plain GETs, and only sent from the cache to
+	 * requests that couldn't have been given anything different.
+	 */
+	conf = ap_get_module_config(r->per_dir_config, &wren_module);
+
+	if(conf->output_cache > 0 && r->method_number == M_GET &&
+			apr_table_get(r->headers_in, "Authorization") == NULL)
+	{
+		cache_key = apr_pstrcat(r->pool, r->hostname ?: "", r->filename, "?",
+				r->args ?: "", NULL);
+
+		if((cached = wren_output_cache_get(cache_key)) != NULL) {
+			WREN_METRIC_ADD(output_cache_hits, 1);
+			wren_output_cache_send(r, cached);
+			wren_output_cache_release(cached);
+
+			return OK;
+		}
+
+		WREN_METRIC_ADD(output_cache_misses, 1);
+	}
+
+	apr_time_t request_start = apr_time_now(), start = request_start;
+
+	if((ret = wren_read_page(r->canonical_filename, &file_buf, &file_len)) !=
+			OK)
+	{
+		WREN_METRIC_ADD(errors, 1);
+		return ret;
+	}
+
+	/*
+	 * Pages without any Wren in them are sent as they are, without a VM,
+	 * under whatever type mod_mime or the configuration gave them, and
+	 * answer conditional requests as a static file would.
+	 */
+	if(raw_wren == false && wren_page_is_static(file_buf)) {
+		if(r->content_type == NULL)
+			ap_set_content_type(r, "text/html");
+
+		ap_update_mtime(r, r->finfo.mtime);
+		ap_set_last_modified(r);
+		ap_set_etag(r);
+
+		if((ret = ap_meets_conditions(r)) != OK) {
+			free(file_buf);
+			return ret;
+		}
+
+		ap_set_content_length(r, file_len);
+		ap_rwrite(file_buf + 2, file_len, r);
+		free(file_buf);
+
+		return OK;
+	}
+
+	/*
+	 * Turned away rather than left to queue without end, which would tie up
+	 * the child's threads and stall even its static files.
+	 */
+	if((wren_state = wren_acquire_state(r)) == NULL) {
+		apr_time_t retry = apr_time_sec(wren_queue_timeout +
+				APR_USEC_PER_SEC - 1);
+
+		free(file_buf);
+		apr_table_setn(r->err_headers_out, "Retry-After",
+				apr_psprintf(r->pool, "%" APR_TIME_T_FMT, MAX(retry, 1)));
+
+		return HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	spans = wren_state->spans;
+	slow = wren_state->slow = wren_slow_start(wren_state, request_start);
+
+	if(cache_key != NULL) {
+		output = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+		wren_state->output = output;
+	}
+
+	start = wren_record_phase(spans, WREN_PHASE_ACQUIRE, start, NULL, false);
+
+	wren_code = wren_translate(file_buf, file_len, raw_wren);
+	start = wren_record_phase(spans, WREN_PHASE_PARSE, start, NULL, false);
+
+	/*
+	 * Compile and run the provided Wren code as two steps, so each can be
+	 * timed on its own and the compiled code can be cached.
+	 */
+	WrenHandle *compiled = wren_compile(wren_state, "main", wren_code);
+
+	start = wren_record_phase(spans, WREN_PHASE_COMPILE, start, NULL,
+			compiled == NULL);
+
+	if(compiled == NULL) {
+		WREN_METRIC_ADD(errors, 1);
+	} else {
+		failed = wren_await_queries(wren_state,
+				wren_run(wren_state, compiled, NULL)) != WREN_RESULT_SUCCESS;
+
+		if(failed == true)
+			WREN_METRIC_ADD(errors, 1);
+
+		wrenReleaseHandle(wren_state->vm, compiled);
+		wren_record_phase(spans, WREN_PHASE_EXECUTE, start, NULL, failed);
+	}
+
+	/* If Web.setContentType() hasn't been called, default to HTML. */
+	ap_set_content_type(r, wren_state->content_type ?: "text/html");
+
+	/* A page-supplied status code, or the default of 200. */
+	r->status = wren_state->status_code;
+
+	/*
+	 * A page-supplied return code that can invoke a server error, defaults
+	 * to OK.
+	 */
+	ret = wren_state->return_code;
+
+	if(wren_state->heap_exceeded == true) {
+		ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_ERR, 0, r,
+				"Aborted %s: heap grew to %zu bytes, over the limit of %zu",
+				r->uri, wren_heap_used(wren_state), wren_heap_limit);
+
+		ret = HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	if(wren_state->budget_exceeded == true) {
+		ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_ERR, 0, r,
+				"Aborted %s after %" APR_TIME_T_FMT "ms and %" APR_INT64_T_FMT
+				" steps: over its execution budget", r->uri,
+				apr_time_as_msec(apr_time_now() - r->request_time),
+				wren_state->steps);
+
+		ret = HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	if(wren_state->heap_exceeded == true || wren_state->budget_exceeded == true)
+		WREN_METRIC_ADD(aborted, 1);
+
+	/* Web.sendFile() and Web.spliceFile() start one if there isn't one. */
+	output = wren_state->output;
+	bool files = wren_state->files;
+
+	/*
+	 * Pages that failed, or that have anything to do with cookies, are
+	 * someone's own and mustn't be cached. So are pages that read request
+	 * headers or variables, which the cache key doesn't cover. Nor are
+	 * files cached, which would have to be read into memory.
+	 */
+	bool cacheable = cache_key != NULL && files == false && failed == false &&
+		ret == OK && r->status == HTTP_OK && wren_state->cookies == NULL &&
+		wren_state->personal == false &&
+		apr_table_get(r->headers_out, "Set-Cookie") == NULL;
+
+	/*
+	 * A page with work deferred has it run by wren_log_transaction(), after
+	 * the response, with its VM suspended until then. Subrequests and
+	 * internal redirects never get there with this request_rec, so theirs
+	 * runs now. An aborted page's is dropped.
+	 */
+	WrenDeferred *deferred = NULL;
+
+	if(wren_state->deferred != NULL && wren_state->heap_exceeded == false &&
+			wren_state->budget_exceeded == false &&
+			(r->main != NULL || r->prev != NULL))
+	{
+		wren_run_deferred(wren_state);
+	}
+
+	if(wren_state->deferred != NULL && wren_state->heap_exceeded == false &&
+			wren_state->budget_exceeded == false)
+	{
+		deferred = apr_palloc(r->pool, sizeof(WrenDeferred));
+		deferred->wren_state = wren_state;
+		deferred->start = request_start;
+		deferred->ret = ret;
+		deferred->server = r->server;
+		deferred->uri = apr_pstrdup(r->pool, r->uri);
+
+		/*
+		 * A pre-cleanup, so it runs before the request's subpools are
+		 * destroyed: the collection on release closes WebDB connections,
+		 * whose pools are among them.
+		 */
+		ap_set_module_config(r->request_config, &wren_module, deferred);
+		apr_pool_pre_cleanup_register(r->pool, deferred,
+				wren_deferred_cleanup);
+		wren_suspend_state(wren_state, &deferred->context);
+	}
+	else {
+		start = apr_time_now();
+		wren_release_state(wren_state);
+		wren_record_phase(spans, WREN_PHASE_RELEASE, start, NULL, false);
+	}
+
+	free(wren_code);
+
+	char *body = NULL;
+	apr_size_t len = 0;
+
+	if(output != NULL && files == false)
+		apr_brigade_pflatten(output, &body, &len, r->pool);
+
+	if(cacheable == true)
+		cached = wren_output_cache_store(r, cache_key, body, len,
+				conf->output_cache);
+
+	if(conf->timing == 1)
+		wren_set_server_timing(r, spans);
+
+	if(cached != NULL) {
+		wren_output_cache_send(r, cached);
+		wren_output_cache_release(cached);
+	}
+	else if(ret == HTTP_NOT_MODIFIED || ret == HTTP_PRECONDITION_FAILED) {
+		/* httpd sends these itself, and they mustn't have a body. */
+	}
+	else if(files == true) {
+		/*
+		 * The whole response goes down in one brigade, so the byterange
+		 * filter can answer Range requests from it.
+		 */
+		APR_BRIGADE_INSERT_TAIL(output,
+				apr_bucket_eos_create(r->connection->bucket_alloc));
+		ap_pass_brigade(r->output_filters, output);
+	}
+	else if(output != NULL) {
+		ap_set_content_length(r, len);
+		ap_rwrite(body, len, r);
+	}
+
+	if(conf->timing == 1 && wren_span_log != NULL && deferred == NULL)
+		wren_log_spans(r, spans, request_start, ret);
+
+	if(slow != NULL && deferred == NULL)
+		wren_log_slow(r, spans, slow, request_start, ret);
+
+	return ret;
+}
+
+/**
+ * Runs the functions a page passed to Web.defer(), under a fresh time and
+ * step budget. Anything they write is thrown away.
+ */
+static void wren_run_deferred(WrenState *wren_state)
+{
+	request_rec *r = wren_state->request_rec;
+	WrenDirConfig *conf = ap_get_module_config(r->per_dir_config,
+			&wren_module);
+	apr_array_header_t *deferred = wren_state->deferred;
+	apr_time_t start = apr_time_now();
+	bool failed = false;
+	WrenHandle *call;
+	int i;
+
+	wren_state->output = apr_brigade_create(r->pool,
+			r->connection->bucket_alloc);
+	wren_state->steps = 0;
+	wren_state->deadline = conf->time_limit > 0 ?
+		start + conf->time_limit : 0;
+
+	call = wrenMakeCallHandle(wren_state->vm, "call()");
+
+	for(i = 0; i < deferred->nelts; ++i) {
+		WrenHandle *fn = APR_ARRAY_IDX(deferred, i, WrenHandle*);
+
+		/* Once over budget, the interrupt would abort every call anyway. */
+		if(wren_state->heap_exceeded == true ||
+				wren_state->budget_exceeded == true)
+			break;
+
+		wrenEnsureSlots(wren_state->vm, 1);
+		wrenSetSlotHandle(wren_state->vm, 0, fn);
+
+		if(wren_await_queries(wren_state, wren_run(wren_state, NULL, call)) !=
+				WREN_RESULT_SUCCESS)
+		{
+			ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_WARNING, 0, r,
+					"Deferred work %d for %s failed", i + 1, r->uri);
+			WREN_METRIC_ADD(errors, 1);
+			failed = true;
+		}
+
+		wrenReleaseHandle(wren_state->vm, fn);
+	}
+
+	wrenReleaseHandle(wren_state->vm, call);
+
+	if(i < deferred->nelts) {
+		ap_log_rerror("mod_wren.c", __LINE__, 1, APLOG_ERR, 0, r,
+				"Aborted deferred work for %s: over its %s budget", r->uri,
+				wren_state->heap_exceeded == true ? "memory" : "execution");
+		WREN_METRIC_ADD(aborted, 1);
+		failed = true;
+
+		for(; i < deferred->nelts; ++i)
+			wrenReleaseHandle(wren_state->vm,
+					APR_ARRAY_IDX(deferred, i, WrenHandle*));
+	}
+
+	wren_state->deferred = NULL;
+
+	apr_brigade_cleanup(wren_state->output);
+	wren_state->output = NULL;
+
+	wren_record_phase(wren_state->spans, WREN_PHASE_DEFER, start, NULL,
+			failed);
+}
+
+/**
+ * Releases the VM of a request whose deferred work never ran, because
+ * wren_log_transaction() wasn't called for it. The work is dropped. Runs as
+ * the request's pool is torn down, so it only logs what it kept aside.
+ */
+static apr_status_t wren_deferred_cleanup(void *data)
+{
+	WrenDeferred *deferred = data;
+	WrenState *wren_state = deferred->wren_state;
+
+	ap_log_error("mod_wren.c", __LINE__, 1, APLOG_WARNING, 0,
+			deferred->server, "Dropped deferred work for %s: the request "
+			"ended without being logged", deferred->uri);
+
+	wren_resume_state(wren_state, &deferred->context);
+	wren_release_state(wren_state);
+
+	return APR_SUCCESS;
+}
+
+/**
+ * Runs after the response has been sent and logged. If the page deferred
+ * any work, this is where it runs, before the VM is finally released.
+ */
+static int wren_log_transaction(request_rec *r)
+{
+	WrenDeferred *deferred = ap_get_module_config(r->request_config,
+			&wren_module);
+	WrenDirConfig *conf = ap_get_module_config(r->per_dir_config,
+			&wren_module);
+	WrenState *wren_state;
+	apr_array_header_t *spans;
+	WrenSlow *slow;
+	apr_time_t start;
+
+	if(deferred == NULL)
+		return DECLINED;
+
+	ap_set_module_config(r->request_config, &wren_module, NULL);
+	/* apr_pool_cleanup_kill() removes pre-cleanups as well. */
+	apr_pool_cleanup_kill(r->pool, deferred, wren_deferred_cleanup);
+
+	/* Possibly not the thread that ran the page. */
+	wren_state = deferred->wren_state;
+	wren_resume_state(wren_state, &deferred->context);
+
+	spans = wren_state->spans;
+	slow = wren_state->slow;
+	wren_run_deferred(wren_state);
+
+	start = apr_time_now();
+	wren_release_state(wren_state);
+	wren_record_phase(spans, WREN_PHASE_RELEASE, start, NULL, false);
+
+	if(conf->timing == 1 && wren_span_log != NULL)
+		wren_log_spans(r, spans, deferred->start, deferred->ret);
+
+	if(slow != NULL)
+		wren_log_slow(r, spans, slow, deferred->start, deferred->ret);
+
+	return OK;
+}
+
+/**
+ * Writes one histogram in Prometheus' text format.
+ */
+static void wren_status_histogram(request_rec *r, WrenPhase phase)
+{
+	const WrenHistogram *histogram = &wren_metrics->phases[phase];
+	const char *name = wren_phase_names[phase];
+	apr_uint64_t cumulative = 0;
+
+	for(size_t i = 0; i <= WREN_HISTOGRAM_BUCKETS; ++i) {
+		cumulative += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+		if(i < WREN_HISTOGRAM_BUCKETS) {
+			ap_rprintf(r, "mod_wren_phase_seconds_bucket{phase=\"%s\","
+					"le=\"%g\"} %" APR_UINT64_T_FMT "\n", name,
+					wren_histogram_bounds[i] / 1e6, cumulative);
+		} else {
+			ap_rprintf(r, "mod_wren_phase_seconds_bucket{phase=\"%s\","
+					"le=\"+Inf\"} %" APR_UINT64_T_FMT "\n", name, cumulative);
+		}
+	}
+
+	ap_rprintf(r, "mod_wren_phase_seconds_sum{phase=\"%s\"} %g\n", name,
+			__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e6);
+	ap_rprintf(r, "mod_wren_phase_seconds_count{phase=\"%s\"} %"
+			APR_UINT64_T_FMT "\n", name,
+			__atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+}
+
+/**
+ * Writes one histogram as a JSON object.
+ */
+static void wren_status_histogram_json(request_rec *r, WrenPhase phase)
+{
+	const WrenHistogram *histogram = &wren_metrics->phases[phase];
+
+	ap_rprintf(r, "\"%s\":{\"count\":%" APR_UINT64_T_FMT ",\"sum_us\":%"
+			APR_UINT64_T_FMT ",\"buckets\":[", wren_phase_names[phase],
+			__atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+			__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED));
+
+	for(size_t i = 0; i <= WREN_HISTOGRAM_BUCKETS; ++i) {
+		if(i < WREN_HISTOGRAM_BUCKETS)
+			ap_rprintf(r, "{\"le_us\":%" APR_UINT64_T_FMT ",",
+					wren_histogram_bounds[i]);
+		else
+			ap_rputs("{\"le_us\":null,", r);
+
+		ap_rprintf(r, "\"count\":%" APR_UINT64_T_FMT "}%s",
+				__atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED),
+				i < WREN_HISTOGRAM_BUCKETS ? "," : "");
+	}
+
+	ap_rputs("]}", r);
+}
+
+/**
+ * Reads one of wren_metric_values.
+ */
+static apr_int64_t wren_metric_value(size_t i)
+{
+	return __atomic_load_n((apr_int64_t*)((char*)wren_metrics +
+				wren_metric_values[i].offset), __ATOMIC_RELAXED);
+}
+
+/**
+ * Reads one of wren_pool_metric_values for a pool.
+ */
+static apr_int64_t wren_pool_metric_value(int pool, size_t i)
+{
+	return __atomic_load_n((apr_int64_t*)((char*)&wren_metrics->pools[pool] +
+				wren_pool_metric_values[i].offset), __ATOMIC_RELAXED);
+}
+
+/**
+ * Escapes a string for a Prometheus label value: backslashes, double quotes
+ * and newlines.
+ */
+static const char* wren_label_escape(apr_pool_t *pool, const char *str)
+{
+	char *out = apr_palloc(pool, strlen(str) * 2 + 1);
+	char *o = out;
+
+	for(const char *c = str; *c != '\0'; ++c) {
+		if(*c == '"' || *c == '\\') {
+			*o++ = '\\';
+			*o++ = *c;
+		} else if(*c == '\n') {
+			*o++ = '\\';
+			*o++ = 'n';
+		} else {
+			*o++ = *c;
+		}
+	}
+
+	*o = '\0';
+
+	return out;
+}
+
+/**
+ * Writes each pool's metrics, as a JSON object or labelled Prometheus samples.
+ * Pool names come from the configuration, so they're escaped for either.
+ */
+static void wren_status_pools(request_rec *r, bool json)
+{
+	for(int i = 0; json && i < wren_num_pools; ++i) {
+		ap_rprintf(r, "%s\"%s\":{", i > 0 ? "," : "",
+				wren_json_escape(r->pool, wren_pools[i].name));
+
+		for(size_t j = 0; j < WREN_NUM_POOL_METRIC_VALUES; ++j) {
+			ap_rprintf(r, "\"%s\":%" APR_INT64_T_FMT "%s",
+					wren_pool_metric_values[j].name,
+					wren_pool_metric_value(i, j),
+					j < WREN_NUM_POOL_METRIC_VALUES - 1 ? "," : "}");
+		}
+	}
+
+	for(size_t j = 0; !json && j < WREN_NUM_POOL_METRIC_VALUES; ++j) {
+		const char *suffix = wren_pool_metric_values[j].gauge ? "" : "_total";
+
+		ap_rprintf(r, "# TYPE mod_wren_pool_%s%s %s\n",
+				wren_pool_metric_values[j].name, suffix,
+				wren_pool_metric_values[j].gauge ? "gauge" : "counter");
+
+		for(int i = 0; i < wren_num_pools; ++i) {
+			ap_rprintf(r, "mod_wren_pool_%s%s{pool=\"%s\"} %" APR_INT64_T_FMT
+					"\n", wren_pool_metric_values[j].name, suffix,
+					wren_label_escape(r->pool, wren_pools[i].name),
+					wren_pool_metric_value(i, j));
+		}
+	}
+}
+
+/**
+ * Serves the metrics in Prometheus' text format, or as JSON when the query
+ * string is "json". Enabled with 'SetHandler wren-status'.
+ */
+static int wren_status_handler(request_rec *r)
+{
+	if(strcmp(r->handler ?: "", "wren-status") != 0)
+		return DECLINED;
+
+	if(r->method_number != M_GET)
+		return HTTP_METHOD_NOT_ALLOWED;
+
+	if(wren_metrics == NULL)
+		return HTTP_SERVICE_UNAVAILABLE;
+
+	if(strcmp(r->args ?: "", "json") == 0) {
+		ap_set_content_type(r, "application/json");
+		ap_rputs("{", r);
+
+		for(size_t i = 0; i < WREN_NUM_METRIC_VALUES; ++i) {
+			ap_rprintf(r, "\"%s\":%" APR_INT64_T_FMT ",",
+					wren_metric_values[i].name, wren_metric_value(i));
+		}
+
+		ap_rputs("\"phases\":{", r);
+
+		for(int i = 0; i < WREN_NUM_PHASES; ++i) {
+			wren_status_histogram_json(r, i);
+			ap_rputs(i < WREN_NUM_PHASES - 1 ? "," : "", r);
+		}
+
+		ap_rputs("},\"pools\":{", r);
+		wren_status_pools(r, true);
+		ap_rputs("}}\n", r);
+
+		return OK;
+	}
+
+	ap_set_content_type(r, "text/plain; version=0.0.4");
+
+	for(size_t i = 0; i < WREN_NUM_METRIC_VALUES; ++i) {
+		const char *suffix = wren_metric_values[i].gauge ? "" : "_total";
+
+		ap_rprintf(r, "# TYPE mod_wren_%s%s %s\n"
+				"mod_wren_%s%s %" APR_INT64_T_FMT "\n",
+				wren_metric_values[i].name, suffix,
+				wren_metric_values[i].gauge ? "gauge" : "counter",
+				wren_metric_values[i].name, suffix, wren_metric_value(i));
+	}
+
+	ap_rputs("# TYPE mod_wren_phase_seconds histogram\n", r);
+
+	for(int i = 0; i < WREN_NUM_PHASES; ++i)
+		wren_status_histogram(r, i);
+
+	wren_status_pools(r, false);
+
+	return OK;
+}
+
+/**
+ * Runs each time the configuration is read, before any directives.
+ */
+static int wren_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+		apr_pool_t *ptemp)
+{
+	wren_extensions = apr_hash_make(pconf);
+	wren_span_log_path = NULL;
+	wren_profile_log_path = NULL;
+	wren_profile_secret = NULL;
+	wren_slow_log_path = NULL;
+	wren_cache_dir = NULL;
+
+	wren_pool_min = WREN_POOL_MIN_DEFAULT;
+	wren_pool_max = 0;
+	wren_pool_defs = apr_array_make(pconf, 4, sizeof(WrenPoolDef));
+	*(WrenPoolDef*)apr_array_push(wren_pool_defs) =
+		(WrenPoolDef){ "default", 0 };
+	wren_pool_idle_timeout = WREN_POOL_IDLE_TIMEOUT_DEFAULT;
+	wren_recycle_requests = 0;
+	wren_recycle_fragmentation = 0;
+	wren_async_db = false;
+	wren_queue_max = -1;
+	wren_queue_timeout = 0;
+	wren_output_cache_size = WREN_OUTPUT_CACHE_SIZE_DEFAULT;
+
+	return OK;
+}
+
+/**
+ * Creates the shared memory for the metrics and opens the span log before the
+ * children are forked.
+ */
+static int wren_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+		apr_pool_t *ptemp, server_rec *s)
+{
+	apr_shm_t *shm;
+	apr_status_t status;
+
+	wren_metrics = NULL;
+	wren_span_log = NULL;
+	wren_profile_log = NULL;
+	wren_slow_log = NULL;
+
+	/* The configuration is read once just to check it; wait for the real run. */
+	if(ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG)
+		return OK;
+
+	if(wren_span_log_path != NULL) {
+		status = apr_file_open(&wren_span_log, wren_span_log_path,
+				APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_APPEND,
+				APR_OS_DEFAULT, pconf);
+
+		if(status != APR_SUCCESS) {
+			ap_log_error("mod_wren.c", __LINE__, 1, APLOG_ERR, status, s,
+					"Couldn't open span log %s", wren_span_log_path);
+			wren_span_log = NULL;
+		}
+	}
+
+	if(wren_profile_log_path != NULL) {
+		status = apr_file_open(&wren_profile_log, wren_profile_log_path,
+				APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_APPEND,
+				APR_OS_DEFAULT, pconf);
+
+		if(status != APR_SUCCESS) {
+			ap_log_error("mod_wren.c", __LINE__, 1, APLOG_ERR, status, s,
+					"Couldn't open profile log %s", wren_profile_log_path);
+			wren_profile_log = NULL;
+		}
+	}
+
+	if(wren_slow_log_path != NULL) {
+		status = apr_file_open(&wren_slow_log, wren_slow_log_path,
+				APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_APPEND,
+				APR_OS_DEFAULT, pconf);
+
+		if(status != APR_SUCCESS) {
+			ap_log_error("mod_wren.c", __LINE__, 1, APLOG_ERR, status, s,
+					"Couldn't open slow log %s", wren_slow_log_path);
+			wren_slow_log = NULL;
+		}
+	}
+
+	/* Prefer anonymous memory, falling back to a file where it's missing. */
+	status = apr_shm_create(&shm, sizeof(WrenMetrics), NULL, pconf);
+
+	if(APR_STATUS_IS_ENOTIMPL(status)) {
+		const char *file = ap_runtime_dir_relative(pconf, WREN_METRICS_SHM_FILE);
+
+		apr_shm_remove(file, pconf);
+		status = apr_shm_create(&shm, sizeof(WrenMetrics), file, pconf);
+	}
+
+	if(status != APR_SUCCESS) {
+		ap_log_error("mod_wren.c", __LINE__, 1, APLOG_ERR, status, s,
+				"Couldn't create shared memory, metrics are disabled");
+		return OK;
+	}
+
+	wren_metrics = apr_shm_baseaddr_get(shm);
+	memset(wren_metrics, 0, sizeof(WrenMetrics));
+
+	return OK;
+}
+
+static void register_hooks(apr_pool_t *pool)
+{
+	ap_hook_pre_config(wren_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_post_config(wren_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_child_init(module_init, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_handler(wren_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_handler(wren_handler, NULL, NULL, APR_HOOK_LAST);
+	ap_hook_log_transaction(wren_log_transaction, NULL, NULL, APR_HOOK_LAST);
+}
+
+/**
+ * Creates the configuration for a directory, with everything unset.
+ */
+static void *wren_create_dir_config(apr_pool_t *pool, char *dir)
+{
+	WrenDirConfig *conf = apr_pcalloc(pool, sizeof(WrenDirConfig));
+
+	conf->time_limit = -1;
+	conf->step_limit = -1;
+	conf->timing = -1;
+	conf->profile = -1;
+	conf->output_cache = -1;
+	conf->pool = -1;
+
+	return conf;
+}
+
+/**
+ * Merges a directory's configuration over its parent's.
+ */
+static void *wren_merge_dir_config(apr_pool_t *pool, void *base_conf,
+		void *new_conf)
+{
+	WrenDirConfig *base = base_conf;
+	WrenDirConfig *add = new_conf;
+	WrenDirConfig *conf = apr_pcalloc(pool, sizeof(WrenDirConfig));
+
+	conf->time_limit = add->time_limit != -1 ? add->time_limit : base->time_limit;
+	conf->step_limit = add->step_limit != -1 ? add->step_limit : base->step_limit;
+	conf->timing = add->timing != -1 ? add->timing : base->timing;
+	conf->profile = add->profile != -1 ? add->profile : base->profile;
+	conf->output_cache = add->output_cache != -1 ? add->output_cache :
+		base->output_cache;
+	conf->pool = add->pool != -1 ? add->pool : base->pool;
+
+	return conf;
+}
+
+/**
+ * Directive callback for setting ModWrenErrors.
+ *
+ * Expects 0 to disable errors, 1 to enable.
+ */
+static const char *wren_set_error_logging(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	wren_error_logging = atoi(arg) > 0 ? true : false;
+
+	return NULL;
+}
+
+/**
+ * Directive callback for ModWrenExtension.
+ *
+ * Loads a native extension library and makes it importable from Wren as
+ * 'name'. The library stays loaded for as long as the configuration does.
+ */
+static const char *wren_add_extension(cmd_parms *cmd, void *cfg,
+		const char *name, const char *path)
+{
+	apr_dso_handle_t *dso;
+	apr_dso_handle_sym_t sym;
+	const ModWrenExtension *extension;
+	char error[256];
+
+	if(strcmp(name, "main") == 0)
+		return "ModWrenExtension can't use the reserved module name 'main'";
+
+	path = ap_server_root_relative(cmd->pool, path);
+
+	if(apr_dso_load(&dso, path, cmd->pool) != APR_SUCCESS) {
+		return apr_psprintf(cmd->pool, "Failed to load extension '%s': %s",
+				path, apr_dso_error(dso, error, sizeof(error)));
+	}
+
+	if(apr_dso_sym(&sym, dso, MOD_WREN_EXTENSION_SYMBOL) != APR_SUCCESS) {
+		return apr_psprintf(cmd->pool, "Extension '%s' doesn't export '%s'",
+				path, MOD_WREN_EXTENSION_SYMBOL);
+	}
+
+	extension = (const ModWrenExtension*)sym;
+
+	if(extension->version != MOD_WREN_EXTENSION_VERSION) {
+		return apr_psprintf(cmd->pool,
+				"Extension '%s' was built for version %d, expected %d",
+				path, extension->version, MOD_WREN_EXTENSION_VERSION);
+	}
+
+	apr_hash_set(wren_extensions, apr_pstrdup(cmd->pool, name),
+			APR_HASH_KEY_STRING, extension);
+
+	return NULL;
+}
+
+/**
+ * Directive callback for the directives taking a size in bytes, which is
+ * stored in the size_t pointed to by the directive's cmd_data.
+ *
+ * Accepts a K, M or G suffix. Negative sizes, which strtoull() would wrap
+ * around, and sizes too big for a size_t are refused.
+ */
+static const char *wren_set_size(cmd_parms *cmd, void *cfg, const char *arg)
+{
+	char *end;
+	unsigned long long size;
+	int shift = 0;
+
+	errno = 0;
+	size = strtoull(arg, &end, 10);
+
+	if(*end == 'K' || *end == 'k')
+		shift = 10, ++end;
+	else if(*end == 'M' || *end == 'm')
+		shift = 20, ++end;
+	else if(*end == 'G' || *end == 'g')
+		shift = 30, ++end;
+
+	if(end == arg || *end != '\0' || strchr(arg, '-') != NULL ||
+			errno != 0 || size > (SIZE_MAX >> shift))
+	{
+		return apr_psprintf(cmd->pool, "%s expects a size, e.g. 64M, not '%s'",
+				cmd->cmd->name, arg);
+	}
+
+	*(size_t*)cmd->info = (size_t)size << shift;
+
+	return NULL;
+}
+
+/**
+ * Reads a directive's whole number, from 0 to max, into out. Anything else,
+ * including trailing characters, is refused.
+ */
+static bool wren_parse_number(const char *arg, long long max, long long *out)
+{
+	char *end;
+	long long value;
+
+	errno = 0;
+	value = strtoll(arg, &end, 10);
+
+	if(end == arg || *end != '\0' || errno != 0 || value < 0 || value > max)
+		return false;
+
+	*out = value;
+
+	return true;
+}
+
+/**
+ * Directive callback for setting ModWrenHeapGrowth, as a percentage. 0 keeps
+ * Wren's own.
+ */
+static const char *wren_set_heap_growth(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	long long percent;
+
+	/* Past ten times the live heap, the collector would hardly ever run. */
+	if(wren_parse_number(arg, 1000, &percent) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a percentage from 0 to "
+				"1000, not '%s'", cmd->cmd->name, arg);
+	}
+
+	wren_heap_growth_percent = (int)percent;
+
+	return NULL;
+}
+
+/**
+ * Directive callback for ModWrenPoolMin and ModWrenPoolMax, stored in the int
+ * pointed to by the directive's cmd_data.
+ */
+static const char *wren_set_pool_size(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	char *end;
+	long size = strtol(arg, &end, 10);
+
+	if(end == arg || *end != '\0' || size < 0 || size > 65536) {
+		return apr_psprintf(cmd->pool, "%s expects a number of VMs, not '%s'",
+				cmd->cmd->name, arg);
+	}
+
+	*(int*)cmd->info = (int)size;
+
+	return NULL;
+}
+
+/**
+ * Directive callback for ModWrenPool.
+ *
+ * Runs a directory's pages in the named pool, which is given 'size' VMs per
+ * child the first time it's named. Naming it again can leave the size out.
+ */
+static const char *wren_set_pool(cmd_parms *cmd, void *cfg, const char *name,
+		const char *size)
+{
+	WrenDirConfig *conf = cfg;
+	WrenPoolDef *defs = (WrenPoolDef*)wren_pool_defs->elts;
+	long vms = 0;
+	char *end;
+	int i;
+
+	if(size != NULL) {
+		vms = strtol(size, &end, 10);
+
+		if(end == size || *end != '\0' || vms < 1 || vms > 65536) {
+			return apr_psprintf(cmd->pool,
+					"%s expects a number of VMs, not '%s'", cmd->cmd->name, size);
+		}
+	}
+
+	for(i = 0; i < wren_pool_defs->nelts; ++i) {
+		if(strcmp(defs[i].name, name) == 0)
+			break;
+	}
+
+	if(i == 0 && size != NULL)
+		return "The default pool's size is set with ModWrenPoolMax";
+
+	if(i < wren_pool_defs->nelts && size != NULL && defs[i].size != vms) {
+		return apr_psprintf(cmd->pool, "Pool '%s' already has %d VMs", name,
+				defs[i].size);
+	}
+
+	if(i == wren_pool_defs->nelts) {
+		if(size == NULL) {
+			return apr_psprintf(cmd->pool,
+					"Pool '%s' needs a size the first time it's named", name);
+		}
+
+		if(wren_pool_defs->nelts == WREN_POOLS_MAX) {
+			return apr_psprintf(cmd->pool, "No more than %d pools can be "
+					"defined", WREN_POOLS_MAX);
+		}
+
+		*(WrenPoolDef*)apr_array_push(wren_pool_defs) =
+			(WrenPoolDef){ apr_pstrdup(cmd->pool, name), (int)vms };
+	}
+
+	conf->pool = i;
+
+	return NULL;
+}
+
+/**
+ * Directive callback for ModWrenPoolIdleTimeout, in seconds. 0 to never trim.
+ */
+static const char *wren_set_pool_idle_timeout(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	long long seconds;
+
+	/* A year is as good as never. */
+	if(wren_parse_number(arg, 365 * 24 * 60 * 60, &seconds) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of seconds, "
+				"not '%s'", cmd->cmd->name, arg);
+	}
+
+	wren_pool_idle_timeout = apr_time_from_sec(seconds);
+
+	return NULL;
+}
 
-	do {
-		char *next_char = MIN(next_quote, MIN(next_percent, next_slash));
+/**
+ * Directive callback for ModWrenRecycleRequests. 0 to never recycle.
+ */
+static const char *wren_set_recycle_requests(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	long long requests;
 
-		if(next_char > file_buf + (*file_index) + html_len)
-			break;
+	if(wren_parse_number(arg, LLONG_MAX, &requests) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of requests, "
+				"not '%s'", cmd->cmd->name, arg);
+	}
 
-		size_t segment_len = next_char - (file_buf + *file_index);
+	wren_recycle_requests = requests;
 
-		parse_write_from_buf(wren_buf, wren_index, wren_capacity, file_buf,
-				file_index, segment_len);
+	return NULL;
+}
 
-		parse_write(wren_buf, wren_index, wren_capacity, "\\");
-		html_len -= segment_len;
+/**
+ * Directive callback for ModWrenRecycleFragmentation, as a percentage.
+ */
+static const char *wren_set_recycle_fragmentation(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	long long percent;
 
-		next_quote   = strchr(file_buf + *file_index + 1, '"')  ?: (char*)INTPTR_MAX;
-		next_percent = strchr(file_buf + *file_index + 1, '%')  ?: (char*)INTPTR_MAX;
-		next_slash   = strchr(file_buf + *file_index + 1, '\\') ?: (char*)INTPTR_MAX;
-	} while(html_len > 0);
+	if(wren_parse_number(arg, 100, &percent) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a percentage, not '%s'",
+				cmd->cmd->name, arg);
+	}
 
-	parse_write_from_buf(wren_buf, wren_index, wren_capacity, file_buf,
-			file_index, html_len);
+	wren_recycle_fragmentation = (int)percent;
 
-	/* Close up the System.write. */
-	parse_write(wren_buf, wren_index, wren_capacity, "\")");
+	return NULL;
 }
 
 /**
- * Parse a Wren page, looking for Wren code blocks, Wren expressions, and
- * regular HTML.
- *
- * Wren blocks (<?wren ... ?>) get inserted straight into the output buffer.
- *
- * Wren expressions (<%= ... %>) get wrapped in an expression call
- * (System.write("%(...)")).
- *
- * The rest is regular HTML, which gets its special characters escaped before
- * being placed in a System.write("...") call.
- *
- * Returns OK with wren_code allocated on success, otherwise a failing HTTP
- * code with no allocation.
+ * Directive callback for ModWrenOutputCache, in seconds. 0 to not cache.
  */
-static int wren_parse(WrenState *wren_state, char **wren_code, bool raw)
+static const char *wren_set_output_cache(cmd_parms *cmd, void *cfg,
+		const char *arg)
 {
-	request_rec *r = wren_state->request_rec;
+	WrenDirConfig *conf = cfg;
+	long long sec;
 
-	/* Open up a file and write it to a buffer we can work from. */
-	FILE *file = fopen(r->canonical_filename, "r");
-	char *file_buf, *out_buf;
-	size_t file_len, read_len;
+	/* Long enough for anything; beyond it the microseconds could overflow. */
+	if(wren_parse_number(arg, 365 * 24 * 60 * 60LL, &sec) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of seconds, "
+				"not '%s'", cmd->cmd->name, arg);
+	}
 
-	if(file == NULL)
-		return errno == ENOENT ? HTTP_NOT_FOUND : HTTP_INTERNAL_SERVER_ERROR;
+	conf->output_cache = apr_time_from_sec(sec);
 
-	fseek(file, 0, SEEK_END);
-	file_len = ftell(file) ?: 1;
-	fseek(file, 0, SEEK_SET);
+	return NULL;
+}
 
-	if(file_len == 0) {
-		*wren_code = strdup("");
-		fclose(file);
-		return OK;
+/**
+ * Directive callback for ModWrenQueueMax.
+ */
+static const char *wren_set_queue_max(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	char *end;
+	long max = strtol(arg, &end, 10);
+
+	if(end == arg || *end != '\0' || max < 0 || max > 65536) {
+		return apr_psprintf(cmd->pool, "%s expects a number of requests, "
+				"not '%s'", cmd->cmd->name, arg);
 	}
 
-	/*
-	 * We're making this +4 larger than needed so we can wrap it in curly braces
-	 * if we return it raw, plus one for NUL.
-	 */
-	file_buf = malloc(file_len + 5);
-	read_len = fread(file_buf + 2, 1, file_len, file);
-	file_buf[file_len + 1] = '\0';
-	fclose(file);
+	wren_queue_max = (int)max;
 
-	if(read_len != file_len) {
-		free(file_buf);
-		return HTTP_INTERNAL_SERVER_ERROR;
-	}
+	return NULL;
+}
 
-	/*
-	 * We want to accept the whole file as Wren without parsing, so we wrap it
-	 * in its own scope and send it on its way.
-	 */
-	if(raw == true) {
-		file_buf[0] = '{';
-		file_buf[1] = '\n';
-		file_buf[file_len + 1] = '\n';
-		file_buf[file_len + 2] = '}';
-		file_buf[file_len + 3] = '\0';
+/**
+ * Directive callback for ModWrenQueueTimeout, in milliseconds. 0 to wait for
+ * as long as it takes.
+ */
+static const char *wren_set_queue_timeout(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	long long msec;
 
-		*wren_code = file_buf;
-		return OK;
+	/* No one is still waiting on a response after a day. */
+	if(wren_parse_number(arg, 24 * 60 * 60 * 1000LL, &msec) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of milliseconds, "
+				"not '%s'", cmd->cmd->name, arg);
 	}
 
-	/*
-	 * Allocate another buffer for the output Wren code. This needs to be
-	 * bigger than the input to account for the function calls and escaping
-	 * we add.
-	 */
-	size_t file_index = 2;
-	size_t out_index = 0;
-	size_t out_capacity = MIN(128, file_len * PARSE_BUFFER_GROWTH_RATE);
+	wren_queue_timeout = apr_time_from_msec(msec);
 
-	out_buf = malloc(out_capacity);
-	parse_write(&out_buf, &out_index, &out_capacity, "{\n");
+	return NULL;
+}
 
-	/*
-	 * Go through the file looking for Wren tags and converting HTML blocks to
-	 * Wren System.write statements.
-	 */
-	while(file_index < file_len) {
-		char *next_block_open = strstr(
-				file_buf + file_index, TAG_BLOCK_OPEN) ?: (char*)INTPTR_MAX;
-		char *next_expr_open = strstr(
-				file_buf + file_index, TAG_EXPR_OPEN) ?: (char*)INTPTR_MAX;
+/**
+ * Directive callback for ModWrenAsyncDB.
+ */
+static const char *wren_set_async_db(cmd_parms *cmd, void *cfg, int flag)
+{
+	wren_async_db = flag;
 
-		/*
-		 * There are no more Wren segments to parse. Add the rest to the output
-		 * buffer as HTML.
-		 */
-		if(next_block_open == (char*)INTPTR_MAX &&
-				next_expr_open == (char*)INTPTR_MAX)
-		{
+	return NULL;
+}
 
-			size_t html_len = file_len - file_index + 1;
-			parse_write_html(&out_buf, &out_index, &out_capacity, file_buf,
-					&file_index, html_len);
-			break;
-		}
+/**
+ * Directive callback for ModWrenTimeLimit, in milliseconds. 0 for no limit.
+ */
+static const char *wren_set_time_limit(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	WrenDirConfig *conf = cfg;
+	long long msec;
 
-		/*
-		 * Otherwise, we've hit a Wren segment.
-		 *
-		 * This could be a Wren code block (<?wren ... ?>) or an expression
-		 * (<%= ... %>), so we check for which tag we've hit. If we're in
-		 * an expression, we wrap it in a System.write("%(...))".
-		 */
-		bool expr = next_block_open > next_expr_open ? true : false;
-		char *next             = expr ? next_expr_open     : next_block_open;
-		char *closing_tag      = expr ? TAG_EXPR_CLOSE     : TAG_BLOCK_CLOSE;
-		size_t opening_tag_len = expr ? TAG_EXPR_OPEN_LEN  : TAG_BLOCK_OPEN_LEN;
-		size_t closing_tag_len = expr ? TAG_EXPR_CLOSE_LEN : TAG_BLOCK_CLOSE_LEN;
+	/* Nothing is meant to run for longer than a day. */
+	if(wren_parse_number(arg, 24 * 60 * 60 * 1000LL, &msec) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of milliseconds, "
+				"not '%s'", cmd->cmd->name, arg);
+	}
 
-		if(file_len - file_index > 0) {
-			size_t html_len = next - (file_buf + file_index);
-			parse_write_html(&out_buf, &out_index, &out_capacity, file_buf,
-					&file_index, html_len);
-		}
+	conf->time_limit = apr_time_from_msec(msec);
 
-		file_index += opening_tag_len + 1;
-		char *closing_tag_pos = strstr(file_buf + file_index, closing_tag);
+	return NULL;
+}
 
-		if(closing_tag_pos == NULL) {
-			/*
-			 * Mismatched opening/closing tag. This should probably be handled,
-			 * but for now, just let Wren fail.
-			 */
-			break;
-		}
+/**
+ * Directive callback for ModWrenStepLimit. 0 for no limit.
+ */
+static const char *wren_set_step_limit(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	WrenDirConfig *conf = cfg;
+	long long steps;
 
-		if(expr == true) {
-			/*
-			 * If the piece of code was one of our System.write() calls, append to it
-			 * to keep the line numbers in check.
-			 */
-			bool prev_was_write = *(out_buf + out_index - 1) == ')';
-			parse_write(&out_buf, &out_index, &out_capacity,
-					prev_was_write ? "+System.write(\"%(" : "System.write(\"%(");
-		}
-		else {
-			/* A full code block belongs on its own line. */
-			parse_write(&out_buf, &out_index, &out_capacity, "\n");
-		}
+	if(wren_parse_number(arg, LLONG_MAX, &steps) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of steps, "
+				"not '%s'", cmd->cmd->name, arg);
+	}
 
-		/*
-		 * Write out whatever we found in our Wren tags and push the file read
-		 * index along to the end of the closing tag.
-		 */
-		size_t write_len = closing_tag_pos - (file_buf + file_index);
-		parse_write_from_buf(&out_buf, &out_index, &out_capacity, file_buf,
-				&file_index, write_len);
+	conf->step_limit = steps;
 
-		if(expr == true)
-			parse_write(&out_buf, &out_index, &out_capacity, ")\")");
+	return NULL;
+}
 
-		file_index += closing_tag_len;
-	}
+/**
+ * Directive callback for setting ModWrenCompileCache.
+ */
+static const char *wren_set_compile_cache(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+#ifndef WREN_BUILD_ID
+	return "ModWrenCompileCache needs mod_wren built with WREN_BUILD_ID "
+		"defined; see the Makefile";
+#endif
 
-	parse_write(&out_buf, &out_index, &out_capacity, "\n}");
+	wren_cache_dir = ap_server_root_relative(cmd->pool, arg);
 
-	out_buf[out_index] = '\0';
-	*wren_code = out_buf;
+	if(wren_cache_dir == NULL)
+		return apr_pstrcat(cmd->pool, "Invalid compile cache path ", arg, NULL);
 
-	free(file_buf);
-	return OK;
+	return NULL;
 }
 
 /**
- * Main Wren handler that gets hooked when we call a Wren file, and converts
- * the file to something that can be understood by the WrenVM and runs it.
+ * Directive callback for setting ModWrenTiming.
  */
-static int wren_handler(request_rec *r)
+static const char *wren_set_timing(cmd_parms *cmd, void *cfg, int flag)
 {
-	WrenState *wren_state;
-	char *wren_code = NULL;
-	int ret = OK;
+	WrenDirConfig *conf = cfg;
 
-	/*
-	 * If the file extension is .wren, we'll use the raw file as Wren code.
-	 * Otherwise we'll parse it as mixed HTML/Wren.
-	 */
-	bool raw_wren = ({
-		const char *file_extension = strrchr(r->canonical_filename, '.');
-		strcmp(file_extension ?: "", ".wren") == 0;
-	});
+	conf->timing = flag;
 
-	/* Make sure the request is for us. */
-	if(strcmp(r->handler ?: "", "wren") != 0)
-		return DECLINED;
+	return NULL;
+}
 
-	/* TODO: allow other methods (most critically, POST). */
-	if(r->method_number != M_GET &&
-			r->method_number != M_POST &&
-			r->method_number != M_PUT &&
-			r->method_number != M_DELETE)
-	{
-		return HTTP_METHOD_NOT_ALLOWED;
-	}
+/**
+ * Directive callback for setting ModWrenSpanLog.
+ */
+static const char *wren_set_span_log(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	wren_span_log_path = ap_server_root_relative(cmd->pool, arg);
 
-	wren_state = wren_acquire_state(r);
+	if(wren_span_log_path == NULL)
+		return apr_pstrcat(cmd->pool, "Invalid span log path ", arg, NULL);
 
-	if((ret = wren_parse(wren_state, &wren_code, raw_wren)) != OK) {
-		wren_release_state(wren_state);
-		return ret;
-	}
+	return NULL;
+}
 
-	/* Run the provided Wren code. */
-	wrenInterpret(wren_state->vm, wren_code);
+/**
+ * Directive callback for setting ModWrenProfile.
+ */
+static const char *wren_set_profile(cmd_parms *cmd, void *cfg, int flag)
+{
+	WrenDirConfig *conf = cfg;
 
-	/* If Web.setContentType() hasn't been called, default to HTML. */
-	ap_set_content_type(r, wren_state->content_type ?: "text/html");
+	conf->profile = flag;
 
-	/* A page-supplied status code, or the default of 200. */
-	r->status = wren_state->status_code;
+	return NULL;
+}
 
-	/*
-	 * A page-supplied return code that can invoke a server error, defaults
-	 * to OK.
-	 */
-	ret = wren_state->return_code;
+/**
+ * Directive callback for setting ModWrenProfileLog.
+ */
+static const char *wren_set_profile_log(cmd_parms *cmd, void *cfg,
+		const char *arg)
+{
+	wren_profile_log_path = ap_server_root_relative(cmd->pool, arg);
 
-	wren_release_state(wren_state);
-	free(wren_code);
+	if(wren_profile_log_path == NULL)
+		return apr_pstrcat(cmd->pool, "Invalid profile log path ", arg, NULL);
 
-	return ret;
+	return NULL;
 }
 
-static void register_hooks(apr_pool_t *pool)
+/**
+ * Directive callback for setting ModWrenProfileSecret.
+ */
+static const char *wren_set_profile_secret(cmd_parms *cmd, void *cfg,
+		const char *arg)
 {
-	ap_hook_child_init(module_init, NULL, NULL, APR_HOOK_MIDDLE);
-	ap_hook_handler(wren_handler, NULL, NULL, APR_HOOK_LAST);
+	wren_profile_secret = apr_pstrdup(cmd->pool, arg);
+
+	return NULL;
 }
 
 /**
- * Directive callback for setting ModWrenErrors.
- *
- * Expects 0 to disable errors, 1 to enable.
+ * Directive callback for setting ModWrenSlowLog: a threshold in milliseconds,
+ * and the file to append requests that take longer to.
  */
-static const char *wren_set_error_logging(cmd_parms *cmd, void *cfg,
-		const char *arg)
+static const char *wren_set_slow_log(cmd_parms *cmd, void *cfg,
+		const char *threshold, const char *path)
 {
-	wren_error_logging = atoi(arg) > 0 ? true : false;
+	long long msec;
+
+	if(wren_parse_number(threshold, 24 * 60 * 60 * 1000LL, &msec) == false) {
+		return apr_psprintf(cmd->pool, "%s expects a number of milliseconds, "
+				"not '%s'", cmd->cmd->name, threshold);
+	}
+
+	wren_slow_log_threshold = apr_time_from_msec(msec);
+	wren_slow_log_path = ap_server_root_relative(cmd->pool, path);
+
+	if(wren_slow_log_path == NULL)
+		return apr_pstrcat(cmd->pool, "Invalid slow log path ", path, NULL);
 
 	return NULL;
 }
@@ -1480,13 +6452,78 @@ static const command_rec wren_directives[] = {
 	AP_INIT_TAKE1("ModWrenErrors", wren_set_error_logging, NULL, RSRC_CONF,
 			"Sets the on-page display of error pages. "
 			"0 to disable errors, 1 to enable"),
+	AP_INIT_TAKE2("ModWrenExtension", wren_add_extension, NULL, RSRC_CONF,
+			"Loads a native extension library, importable from Wren by name"),
+	AP_INIT_TAKE1("ModWrenHeapInitial", wren_set_size, &wren_initial_heap_size,
+			RSRC_CONF, "Bytes a VM allocates before its first collection"),
+	AP_INIT_TAKE1("ModWrenHeapMin", wren_set_size, &wren_min_heap_size,
+			RSRC_CONF, "Smallest heap size a VM collects at"),
+	AP_INIT_TAKE1("ModWrenHeapGrowth", wren_set_heap_growth, NULL, RSRC_CONF,
+			"Percent the heap grows by before the next collection"),
+	AP_INIT_TAKE1("ModWrenHeapLimit", wren_set_size, &wren_heap_limit,
+			RSRC_CONF, "Heap size at which a page is aborted with a 503"),
+	AP_INIT_TAKE1("ModWrenHeapWatermark", wren_set_size, &wren_heap_watermark,
+			RSRC_CONF, "Heap size a VM may keep after a request before it's "
+			"replaced"),
+	AP_INIT_TAKE1("ModWrenPoolMin", wren_set_pool_size, &wren_pool_min,
+			RSRC_CONF, "VMs each child keeps, however idle"),
+	AP_INIT_TAKE1("ModWrenPoolMax", wren_set_pool_size, &wren_pool_max,
+			RSRC_CONF, "Most VMs each child creates. 0 for one per thread"),
+	AP_INIT_TAKE12("ModWrenPool", wren_set_pool, NULL, RSRC_CONF | ACCESS_CONF,
+			"Pool of VMs to run pages in, and its VMs per child the first "
+			"time it's named"),
+	AP_INIT_TAKE1("ModWrenPoolIdleTimeout", wren_set_pool_idle_timeout, NULL,
+			RSRC_CONF, "Seconds a VM may go unused before it's destroyed"),
+	AP_INIT_TAKE1("ModWrenRecycleRequests", wren_set_recycle_requests, NULL,
+			RSRC_CONF, "Requests a VM runs before it's replaced"),
+	AP_INIT_TAKE1("ModWrenRecycleFragmentation", wren_set_recycle_fragmentation,
+			NULL, RSRC_CONF, "Percent of a VM's pinned arena memory that may "
+			"go unused before it's replaced"),
+	AP_INIT_TAKE1("ModWrenQueueMax", wren_set_queue_max, NULL, RSRC_CONF,
+			"Requests that may wait for one of a pool's VMs in each child "
+			"before more are turned away with a 503"),
+	AP_INIT_TAKE1("ModWrenQueueTimeout", wren_set_queue_timeout, NULL,
+			RSRC_CONF, "Milliseconds a request may wait for a VM before it's "
+			"turned away with a 503"),
+	AP_INIT_FLAG("ModWrenAsyncDB", wren_set_async_db, NULL, RSRC_CONF,
+			"Free a page's VM for other requests while its queries run"),
+	AP_INIT_TAKE1("ModWrenTimeLimit", wren_set_time_limit, NULL,
+			RSRC_CONF | ACCESS_CONF,
+			"Milliseconds a page may run for before it's aborted"),
+	AP_INIT_TAKE1("ModWrenStepLimit", wren_set_step_limit, NULL,
+			RSRC_CONF | ACCESS_CONF,
+			"Calls and loop iterations a page may run before it's aborted"),
+	AP_INIT_TAKE1("ModWrenOutputCache", wren_set_output_cache, NULL,
+			RSRC_CONF | ACCESS_CONF,
+			"Seconds to cache each page's output for, precompressed"),
+	AP_INIT_TAKE1("ModWrenOutputCacheSize", wren_set_size,
+			&wren_output_cache_size, RSRC_CONF,
+			"Most output each child caches, counting every encoding"),
+	AP_INIT_TAKE1("ModWrenCompileCache", wren_set_compile_cache, NULL,
+			RSRC_CONF, "Directory to keep compiled pages in, shared by children"),
+	AP_INIT_FLAG("ModWrenTiming", wren_set_timing, NULL,
+			RSRC_CONF | ACCESS_CONF,
+			"Add a Server-Timing header, and log spans if ModWrenSpanLog is set"),
+	AP_INIT_TAKE1("ModWrenSpanLog", wren_set_span_log, NULL, RSRC_CONF,
+			"File to append OpenTelemetry spans to for pages with ModWrenTiming"),
+	AP_INIT_FLAG("ModWrenProfile", wren_set_profile, NULL,
+			RSRC_CONF | ACCESS_CONF,
+			"Sample every page's call stack into ModWrenProfileLog"),
+	AP_INIT_TAKE1("ModWrenProfileLog", wren_set_profile_log, NULL, RSRC_CONF,
+			"File to append profiled pages' collapsed stacks to"),
+	AP_INIT_TAKE1("ModWrenProfileSecret", wren_set_profile_secret, NULL,
+			RSRC_CONF, "Value of an X-Wren-Profile header that has a request "
+			"profiled"),
+	AP_INIT_TAKE2("ModWrenSlowLog", wren_set_slow_log, NULL, RSRC_CONF,
+			"Milliseconds after which a request is slow, and the file to "
+			"append slow requests to"),
 	{ NULL }
 };
 
 module AP_MODULE_DECLARE_DATA wren_module = {
 	STANDARD20_MODULE_STUFF,
-	NULL,
-	NULL,
+	wren_create_dir_config,
+	wren_merge_dir_config,
 	NULL,
 	NULL,
 	wren_directives,
@@ -0,0 +1,63 @@
+#ifndef MOD_WREN_EXTENSION_H
+#define MOD_WREN_EXTENSION_H
+
+/**
+ * Interface for native mod_wren extensions.
+ *
+ * An extension is a shared library loaded with the ModWrenExtension directive:
+ *
+ *   ModWrenExtension pricing /usr/lib/mod_wren/pricing.so
+ *
+ * The library exports a ModWrenExtension named "mod_wren_extension". Its
+ * source is handed to Wren whenever a page runs 'import "pricing"', and the
+ * foreign methods and classes it declares are bound from the tables below.
+ */
+
+#include <httpd.h>
+#include <stdbool.h>
+
+#include "wren.h"
+
+#define MOD_WREN_EXTENSION_VERSION 1
+#define MOD_WREN_EXTENSION_SYMBOL "mod_wren_extension"
+
+/**
+ * A foreign method, matching a 'foreign' declaration in the module source.
+ * The signature uses Wren's format, e.g. "price(_,_)" or "total".
+ */
+typedef struct {
+	const char *class_name;
+	bool is_static;
+	const char *signature;
+	WrenForeignMethodFn fn;
+} ModWrenMethod;
+
+/**
+ * Allocate and finalize functions for a 'foreign class'.
+ */
+typedef struct {
+	const char *class_name;
+	WrenForeignMethodFn allocate;
+	WrenFinalizerFn finalize;
+} ModWrenClass;
+
+/**
+ * Both tables end with an entry whose class_name is NULL, and either can be
+ * NULL if the module has nothing to bind.
+ */
+typedef struct {
+	int version; /* Always MOD_WREN_EXTENSION_VERSION. */
+	const char *source;
+	const ModWrenMethod *methods;
+	const ModWrenClass *classes;
+} ModWrenExtension;
+
+/**
+ * Returns the request being served by the VM running a foreign method.
+ */
+static inline request_rec* mod_wren_request(WrenVM *vm)
+{
+	return *(request_rec**)wrenGetUserData(vm);
+}
+
+#endif